@@ -0,0 +1,142 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Stats endpoint: a minimal HTTP listener that answers every connection with
+ * the JSON document built by stats_json() and closes it.
+ *
+ *   curl http://127.0.0.1:4048/
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#include "compat.h"
+#include "miner.h"
+
+static int api_sock = -1;
+
+static void api_send_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = send(fd, buf, len, 0);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void *api_thread(void *userdata)
+{
+	char req[1024], hdr[160];
+
+	while (1) {
+		struct timeval tv = { 1, 0 };
+		char *body;
+		int fd;
+
+		fd = accept(api_sock, NULL, NULL);
+		if (fd < 0) {
+			/* EMFILE and friends persist: pause before retrying */
+			if (errno != EINTR && errno != ECONNABORTED) {
+				applog(LOG_ERR, "api: accept failed: %s", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+
+		/* the request itself does not matter, but drain what is there */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *) &tv, sizeof(tv));
+		if (recv(fd, req, sizeof(req), 0) < 0) {
+			close(fd);
+			continue;
+		}
+
+		body = stats_json();
+		snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %lu\r\n\r\n", (unsigned long) strlen(body));
+		api_send_all(fd, hdr, strlen(hdr));
+		api_send_all(fd, body, strlen(body));
+		free(body);
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * Opens a listening TCP socket on "[ADDR:]PORT" (address defaults to
+ * loopback). Returns the socket, -1 on error.
+ */
+int net_listen(const char *bind_str, const char *what)
+{
+	struct sockaddr_in addr;
+	const char *colon = strrchr(bind_str, ':');
+	char host[64] = "127.0.0.1";
+	int fd, one = 1;
+
+	if (colon) {
+		if ((size_t) (colon - bind_str) >= sizeof(host))
+			goto err_out;
+		memcpy(host, bind_str, colon - bind_str);
+		host[colon - bind_str] = '\0';
+		bind_str = colon + 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(bind_str));
+	if (!addr.sin_port || (addr.sin_addr.s_addr = inet_addr(host)) == INADDR_NONE)
+		goto err_out;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		goto err_out;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 16)) {
+		applog(LOG_ERR, "%s: cannot listen on %s:%s: %s", what, host, bind_str, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	applog(LOG_INFO, "%s listening on %s:%s", what, host, bind_str);
+	return fd;
+
+err_out:
+	applog(LOG_ERR, "%s: invalid bind address %s", what, bind_str);
+	return -1;
+}
+
+bool api_start(const char *bind_str)
+{
+	pthread_t pth;
+
+	api_sock = net_listen(bind_str, "stats endpoint");
+	if (api_sock < 0)
+		return false;
+	if (pthread_create(&pth, NULL, api_thread, NULL)) {
+		applog(LOG_ERR, "stats endpoint thread create failed");
+		close(api_sock);
+		return false;
+	}
+	pthread_detach(pth);
+	return true;
+}
@@ -12,14 +12,17 @@
 #define _GNU_SOURCE
 
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
+#include <math.h>
 #if !defined(_WIN64) && !defined(_WIN32)
 	#include <sys/mman.h>
 #endif
@@ -95,14 +98,49 @@ enum workio_commands {
 	WC_GET_WORK, WC_SUBMIT_WORK,
 };
 
+struct share_rec;
+
 struct workio_cmd {
 	enum workio_commands cmd;
 	struct thr_info *thr;
 	union {
 		struct work *work;
+		struct share_rec *share;
 	} u;
 };
 
+enum hugepage_policy {
+	HUGEPAGE_AUTO,    /* 1G hugetlb, then 2M hugetlb, then THP */
+	HUGEPAGE_1G,      /* 1 GB hugetlb pages */
+	HUGEPAGE_2M,      /* 2 MB hugetlb pages */
+	HUGEPAGE_THP,     /* transparent huge pages */
+	HUGEPAGE_4K,      /* base pages only */
+};
+
+static const char *hugepage_names[] = {
+	[HUGEPAGE_AUTO] = "auto",
+	[HUGEPAGE_1G] =   "1g",
+	[HUGEPAGE_2M] =   "2m",
+	[HUGEPAGE_THP] =  "thp",
+	[HUGEPAGE_4K] =   "4k",
+};
+
+enum placement_policy {
+	PLACE_NONE,       /* leave it to the scheduler */
+	PLACE_COMPACT,    /* fill a core's SMT siblings, then a node */
+	PLACE_SPREAD,     /* one thread per core, nodes taking turns */
+	PLACE_PHYSICAL,   /* compact, without SMT siblings */
+	PLACE_MASK,       /* the CPUs given, in order */
+};
+
+static const char *placement_names[] = {
+	[PLACE_NONE] =     "none",
+	[PLACE_COMPACT] =  "compact",
+	[PLACE_SPREAD] =   "spread",
+	[PLACE_PHYSICAL] = "physical",
+	[PLACE_MASK] =     "mask",
+};
+
 enum mining_algo {
 	ALGO_SCRYPT,      /* scrypt(1024,1,1) */
 	ALGO_SHA256D,     /* SHA-256d */
@@ -153,7 +191,13 @@ static json_t *opt_config;
 static const bool opt_time = true;
 static const enum mining_algo opt_algo = ALGO_WILD_KECCAK;
 static int opt_n_threads = 1;
+static enum hugepage_policy opt_hugepages = HUGEPAGE_AUTO;
 static int num_processors;
+static enum placement_policy opt_placement = PLACE_NONE;
+#ifdef __linux
+static cpu_set_t opt_placement_mask;
+#endif
+static int *thr_cpus;	/* per miner, NULL while not pinning */
 static char *rpc_url = NULL;
 static char *rpc_userpass;
 static char *rpc_user, *rpc_pass;
@@ -165,12 +209,41 @@ static int work_thr_id;
 int longpoll_thr_id = -1;
 int stratum_thr_id = -1;
 struct work_restart *work_restart = NULL;
-static struct stratum_ctx stratum;
+
+/* pools in priority order; pools[0] is the primary (first -o) */
+#define MAX_POOLS 8
+#define STRATUM_PREFIX "stratum+tcp://"
+
+enum pool_state {
+	POOL_DOWN,	/* (re)connecting */
+	POOL_STANDBY,	/* logged in, serviced by its own pool thread */
+	POOL_ACTIVE,	/* lent to the stratum thread as the job source */
+	POOL_DEAD	/* gave up after --retries */
+};
+
+struct pool_info {
+	int id;
+	char *url;
+	char *user, *pass;	/* NULL: use -u/-p */
+	struct stratum_ctx ctx;
+	enum pool_state state;
+	bool want_active;
+	time_t last_login;
+};
+
+static struct pool_info pools[MAX_POOLS];
+static int num_pools = 1;
+static pthread_mutex_t pools_lock;
+static pthread_cond_t pools_cond;
+/* the active session; changed by the stratum thread under session_lock,
+ * which the other threads take to submit through it */
+static pthread_mutex_t session_lock;
+static struct stratum_ctx *stratum = &pools[0].ctx;
 char rpc2_id[65] = "";
-static char *rpc2_blob = NULL;
-static int rpc2_bloblen = 0;
+static unsigned char rpc2_blob[128];
+static size_t rpc2_bloblen = 0;
 static uint32_t rpc2_target = 0;
-static char *rpc2_job_id = NULL;
+static char rpc2_job_id[64];
 unsigned int CUDABlocks = 0, CUDAThreads = 0;
 
 volatile bool stratum_have_work = false;
@@ -186,17 +259,64 @@ static char last_found_nonce[200];
 static time_t prev_save = 0;
 static const char * pscratchpad_url = NULL;
 static const char * pscratchpad_local_cache = NULL;
+static size_t scratchpad_map_len = 0;
+static size_t scratchpad_page_size = 4096;
+static char scratchpad_backing[128] = "malloc";
+static bool scratchpad_ready = false;
+static bool opt_scratchpad_fsync = false;
+static char *opt_api_bind = NULL;
+static char *opt_proxy_listen = NULL;
+int opt_submit_window = 2;
+static int opt_outage_grace = 120;
+static int opt_batch_ms = 100;
+static int opt_nonce_prefix = 0;
+static int opt_throttle_psi = 0;
+static double opt_throttle_load = 0;
+/* when the pool went away, 0 while there is one */
+static volatile time_t pool_offline_since = 0;
+static pthread_mutex_t scratchpad_ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scratchpad_ready_cond = PTHREAD_COND_INITIALIZER;
+/* miners without work sleep on work_avail_cond, see work_avail_notify() */
+static pthread_mutex_t work_avail_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_avail_cond = PTHREAD_COND_INITIALIZER;
+static struct timeval work_avail_tv;	/* last wakeup, under work_avail_lock */
+static struct latency_hist lat_wake;	/* wakeup -> paused miner hashing again */
 char **devstrs = NULL;
 
 pthread_mutex_t applog_lock;
-static pthread_mutex_t stats_lock;
 static pthread_mutex_t rpc2_job_lock;
 static pthread_mutex_t rpc2_login_lock;
 static pthread_mutex_t rpc2_getscratchpad_lock;
+static pthread_mutex_t scratchpad_lock;	/* held while the scratchpad is patched or snapshotted */
+static uint64_t scratchpad_generation = 0;	/* bumped on every change, under scratchpad_lock */
 
 static unsigned long accepted_count = 0L;
 static unsigned long rejected_count = 0L;
-static float *thr_hashrates;
+static unsigned long stale_count = 0L;
+
+/*
+ * Per miner thread statistics. Each thread writes only its own entry, two
+ * cache lines long so that no neighbour shares a line with it however the
+ * array is aligned, and readers add them up when asked, without a lock.
+ * Besides the rate of the last scan there are exponentially decaying
+ * averages over 1, 15 and 60 minutes of wall time, updated every batch;
+ * readers decay them further by the time since, so a stalled GPU drops
+ * out of the sum.
+ */
+#define RATE_WINDOWS	3
+
+static const int rate_window_secs[RATE_WINDOWS] = { 60, 15 * 60, 60 * 60 };
+
+struct thr_stats {
+	volatile uint64_t hashes;	/* since start */
+	volatile uint64_t scan_us;	/* time spent scanning */
+	volatile double last;		/* hashes/s of the last scan */
+	volatile double ewma[RATE_WINDOWS];
+	volatile uint64_t ewma_us;	/* when ewma was last updated */
+	char pad[128 - 7 * sizeof(uint64_t)];
+};
+
+static struct thr_stats *thr_stats;
 
 #ifdef HAVE_GETOPT_LONG
 #include <getopt.h>
@@ -215,8 +335,37 @@ Options:\n\
 	-a, --algo=ALGO       specify the algorithm to use\n\
 	                      wildkeccak   WildKeccak\n\
 	-k  --scratchpad=URL  URL of inital scratchpad file\n\
+	    --hugepages=POLICY  scratchpad page backing: auto, 1g, 2m, thp, 4k\n\
+	                      (default: auto)\n\
+	    --cpu-affinity=POLICY  pin the miner threads: compact, spread,\n\
+	                      physical (one per core), a hex mask (0x0f) or a\n\
+	                      cpu list (0-3,8); stratum/workio get the rest\n\
+	    --throttle=PCT    share the host: back off while its CPU or memory\n\
+	                      pressure (PSI avg10) is over PCT%%, parking\n\
+	                      miner threads, then cutting the duty cycle\n\
+	                      (default: off)\n\
+	    --throttle-load=N  also back off while the 1 minute load average\n\
+	                      per CPU is over N\n\
+	    --scratchpad-fsync  fsync the scratchpad cache file when saving it\n\
+	    --api-bind=[ADDR:]PORT  serve JSON stats (rates, share/job latency)\n\
+	                      over HTTP (default address 127.0.0.1)\n\
+	    --proxy-listen=[ADDR:]PORT  serve the pool session to local miners\n\
+	                      (stratum, default address 127.0.0.1)\n\
+	    --submit-window=MS  hold a share up to MS ms so shares found together\n\
+	                      go out in one write (default: 2, 0 sends at once)\n\
+	    --outage-grace=N  keep hashing the last job for N seconds while no\n\
+	                      pool is reachable, shares are sent after\n\
+	                      reconnecting (default: 120)\n\
+	    --batch-ms=MS     aim for scan batches of MS ms, shorter while new\n\
+	                      jobs are slow to reach the GPUs (default: 100)\n\
+	    --queue-bench     time the thread queues under contention and exit\n\
+	    --nonce-prefix=N  nonce byte 7 for this instance (0-255), rigs sharing\n\
+	                      one login must use different ones (default: 0)\n\
+	    --device=NAME     scan backend: cuda, or cpu to run the GPU pipeline\n\
+	                      on the host (default: cuda when built with it)\n\
 	-l  --launch-config   threadsxblocks\n\
-	-o, --url=URL         URL of mining server\n\
+	-o, --url=URL         URL of mining server; repeat to add stratum failover\n\
+	                      pools in priority order (user:pass@ per URL)\n\
 	-O, --userpass=U:P    username:password pair for mining server\n\
 	-u, --user=USERNAME   username for mining server\n\
 	-p, --pass=PASSWORD   password for mining server\n\
@@ -271,6 +420,7 @@ static struct option const options[] = {
 	{ "config", 1, NULL, 'c' },
 	{ "debug", 0, NULL, 'D' },
 	{ "help", 0, NULL, 'h' },
+	{ "hugepages", 1, NULL, 1010 },
 	{ "keepalive", 0, NULL, 'K' },
 	{ "no-longpoll", 0, NULL, 1003 },
 	{ "no-redirect", 0, NULL, 1009 },
@@ -282,6 +432,18 @@ static struct option const options[] = {
 	{ "retries", 1, NULL, 'r' },
 	{ "retry-pause", 1, NULL, 'R' },
 	{ "scantime", 1, NULL, 's' },
+	{ "scratchpad-fsync", 0, NULL, 1011 },
+	{ "api-bind", 1, NULL, 1012 },
+	{ "proxy-listen", 1, NULL, 1013 },
+	{ "submit-window", 1, NULL, 1014 },
+	{ "outage-grace", 1, NULL, 1015 },
+	{ "batch-ms", 1, NULL, 1016 },
+	{ "queue-bench", 0, NULL, 1017 },
+	{ "nonce-prefix", 1, NULL, 1018 },
+	{ "device", 1, NULL, 1019 },
+	{ "cpu-affinity", 1, NULL, 1020 },
+	{ "throttle", 1, NULL, 1021 },
+	{ "throttle-load", 1, NULL, 1022 },
 #ifdef HAVE_SYSLOG_H
 	{ "syslog", 0, NULL, 'S' },
 #endif
@@ -294,12 +456,93 @@ static struct option const options[] = {
 	{ 0, 0, 0, 0 }
 };
 
+/*
+ * Job propagation tracer: each stage a job passes on its way from the
+ * stratum socket to the GPUs is stamped, the stratum side in
+ * rpc2_job_apply() and when stratum_thread publishes the job, and every
+ * miner thread closes the trace when it starts hashing the job.
+ */
+struct job_trace {
+	char job_id[64];
+	struct timeval rx;		/* line complete in the receive buffer */
+	struct timeval decoded;		/* job fields taken over */
+	struct timeval patched;		/* scratchpad uploaded */
+	struct timeval published;	/* handed to the miners */
+};
+
+struct thr_trace {
+	struct latency_hist notice;	/* published -> this thread hashing it */
+	struct latency_hist total;	/* received -> this thread hashing it */
+};
+
+/* written by the stratum thread only */
+static struct job_trace job_trace;
+static struct latency_hist lat_trace_decode, lat_trace_patch, lat_trace_publish;
+static struct thr_trace *thr_traces;
+
+/* the stratum thread's current job, for itself and the submit path */
 static struct work g_work;
 static time_t g_work_time;
 static pthread_mutex_t g_work_lock;
 
+/*
+ * A miner's share of a job's nonces, [pos, end) packed into one word: only
+ * the owner advances pos, miners that ran dry steal by lowering end.
+ */
+struct nonce_range {
+	volatile uint64_t r;
+	char pad[64 - sizeof(uint64_t)];
+};
+
+#define RANGE(pos, end)	((uint64_t) (pos) << 32 | (uint32_t) (end))
+#define RANGE_POS(r)	((uint32_t) ((r) >> 32))
+#define RANGE_END(r)	((uint32_t) (r))
+#define RANGE_LEFT(r)	(RANGE_END(r) - RANGE_POS(r))
+
+/*
+ * The job as the miner threads see it: an immutable copy of g_work behind
+ * cur_job, with job_gen bumped once the pointer is in place. Miners spot a
+ * new job with a single load of job_gen and read it under a hazard pointer,
+ * so switching jobs takes no lock. Replaced jobs wait on job_retired until
+ * a job_publish() finds no hazard pointing at them.
+ *
+ * Of the 8 blob nonce bytes the miners hand out 1..4 and the GPUs scan them.
+ * Bytes 5..6 are the job's lane, 7 is --nonce-prefix and 8 is left as the
+ * pool or proxy sent it. Once a lane is exhausted the stratum thread
+ * republishes the job on the next one, see job_lane_wanted.
+ */
+struct job_pub {
+	unsigned int gen;
+	struct work work;
+	struct job_trace trace;
+	struct stratum_ctx *ctx;
+	int started;		/* set by the first miner to hash it */
+	int exhausted;		/* set by the first miner left without nonces */
+	volatile uint64_t nonce_next;	/* nonces not handed out yet start here */
+	uint64_t nonce_end;
+	struct nonce_range *ranges;	/* one per miner thread */
+	unsigned int lane;	/* nonce bytes 5..6 */
+	struct job_pub *next;	/* on job_retired */
+};
+
+struct job_hazard {
+	struct job_pub *volatile job;
+	char pad[64 - sizeof(void *)];	/* one cache line per miner */
+};
+
+static struct job_pub *volatile cur_job;
+static volatile unsigned int job_gen;
+static struct job_hazard *job_hazards;
+static struct job_pub *job_retired;	/* stratum thread only */
+/* gen of a job whose lane ran out, for the stratum thread to republish */
+static volatile unsigned int job_lane_wanted;
+static unsigned long nonce_steals;
+static unsigned long scan_candidates, scan_dropped;
+
 static bool rpc2_login(CURL *curl);
 static void workio_cmd_free(struct workio_cmd *wc);
+static void place_miner_thread(int thr_id);
+static void place_service_thread(void);
 
 json_t *json_rpc2_call_recur(CURL *curl, const char *url,
 							 const char *userpass, json_t *rpc_req,
@@ -604,7 +847,9 @@ bool addendum_decode(const json_t *addm)
 		applog(LOG_ERR, "JSON height in addendum-1 (%lld-1) missmatched with current_scratchpad_hi.height(%lld), reverting scratchpad and re-login", hi.height, current_scratchpad_hi.height);
 		revert_scratchpad();
 		//init re-login
+		pthread_mutex_lock(&session_lock);
 		strcpy(rpc2_id, "");
+		pthread_mutex_unlock(&session_lock);
 		return false;
 	}
 
@@ -676,24 +921,100 @@ bool addendums_decode(const json_t *job)
 		return false;
 	}
 
+	bool ret = true;
 	unsigned int add_sz = json_array_size(paddms);
-	for (int i = 0; i < add_sz; i++)
+
+	pthread_mutex_lock(&scratchpad_lock);
+	for (int i = 0; i < add_sz && ret; i++)
 	{
 		json_t *addm = json_array_get(paddms, i);
 		if (!addm )
 		{
 			applog(LOG_ERR, "Internal error: failed to get addm");
-			return false;
+			ret = false;
+			break;
 		}
-		if(!addendum_decode(addm))
-			return false;
+		ret = addendum_decode(addm);
+	}
+	scratchpad_generation++;
+	pthread_mutex_unlock(&scratchpad_lock);
+
+	return ret;
+}
+
+/*
+ * Called after stratum_have_work, scratchpad_size or pool_offline_since
+ * changed in a way that may let paused miners run again.
+ */
+static void work_avail_notify(void)
+{
+	pthread_mutex_lock(&work_avail_lock);
+	gettimeofday(&work_avail_tv, NULL);
+	pthread_cond_broadcast(&work_avail_cond);
+	pthread_mutex_unlock(&work_avail_lock);
+}
+
+/*
+ * Makes job the current job and, if work is given, builds work from it.
+ * Shared by the JSON decoder below and the stratum fast path.
+ */
+bool rpc2_job_apply(const struct rpc2_job *job, struct work *work)
+{
+	if (job->bloblen)
+	{
+		pthread_mutex_lock(&rpc2_job_lock);
+		memcpy(rpc2_blob, job->blob, job->bloblen);
+		rpc2_bloblen = job->bloblen;
+		/* proxy mode: top nonce byte 0 is ours, local miners get the others */
+		if (opt_proxy_listen)
+			rpc2_blob[8] = 0;
+
+		if(rpc2_target != job->target) {
+			double difficulty = (((double) 0xffffffff) / job->target);
+			applog(LOG_INFO, "Pool set diff to %.0f", difficulty);
+			rpc2_target = job->target;
+		}
+
+		strcpy(rpc2_job_id, job->job_id);
+		pthread_mutex_unlock(&rpc2_job_lock);
+
+		gettimeofday(&job_trace.decoded, NULL);
+		job_trace.rx = stratum->line_rx.tv_sec ? stratum->line_rx : job_trace.decoded;
+		strcpy(job_trace.job_id, job->job_id);
+		hist_record_since(&lat_trace_decode, &job_trace.rx);
 	}
+	if(work)
+	{
+		if (!rpc2_bloblen) {
+			applog(LOG_ERR, "Requested work before work was received");
+			return false;
+		}
+		memcpy(work->data, rpc2_blob, rpc2_bloblen);
+		memset(work->target, 0xff, sizeof(work->target));
+		//*((uint64_t*)&work->target[6]) = rpc2_target;
+		work->target[7] = rpc2_target;
 
+		if (!work->job_id || strcmp(work->job_id, rpc2_job_id))
+		{
+			free(work->job_id);
+			work->job_id = strdup(rpc2_job_id);
+		}
+		stratum_have_work = true;
+		work_avail_notify();
+	}
+	scan_dev->upload(opt_n_threads, 0, scratchpad_size);
+	if (job->bloblen)
+	{
+		gettimeofday(&job_trace.patched, NULL);
+		hist_record_since(&lat_trace_patch, &job_trace.decoded);
+	}
 	return true;
 }
 
 bool rpc2_job_decode(const json_t *job, struct work *work)
 {
+	struct rpc2_job j;
+
 	if (!jsonrpc_2) {
 		applog(LOG_ERR, "Tried to decode job without JSON-RPC 2.0");
 		return false;
@@ -713,6 +1034,11 @@ bool rpc2_job_decode(const json_t *job, struct work *work)
 
 
 	const char *job_id = json_string_value(tmp);
+	if (!job_id || strlen(job_id) >= sizeof(j.job_id)) {
+		applog(LOG_ERR, "JSON inval job id");
+		goto err_out;
+	}
+	strcpy(j.job_id, job_id);
 	tmp = json_object_get(job, "blob");
 	if (!tmp) {
 		applog(LOG_ERR, "JSON inval blob");
@@ -725,66 +1051,166 @@ bool rpc2_job_decode(const json_t *job, struct work *work)
 		applog(LOG_ERR, "JSON invalid blob length");
 		goto err_out;
 	}
+	j.bloblen = blobLen / 2;
 	if (blobLen != 0)
 	{
-		pthread_mutex_lock(&rpc2_job_lock);
-		char *blob = malloc(blobLen / 2);
-		if (!hex2bin(blob, hexblob, blobLen / 2))
+		if (!hex2bin(j.blob, hexblob, blobLen / 2))
 		{
 			applog(LOG_ERR, "JSON inval blob");
-			pthread_mutex_unlock(&rpc2_job_lock);
 			goto err_out;
 		}
-		if (rpc2_blob) {
-			free(rpc2_blob);
-		}
-		rpc2_bloblen = blobLen / 2;
-		rpc2_blob = malloc(rpc2_bloblen);
-		memcpy(rpc2_blob, blob, blobLen / 2);
+		j.target = rpc2_target;
+		jobj_binary(job, "target", &j.target, 4);
+	}
+	return rpc2_job_apply(&j, work);
 
-		free(blob);
+err_out:
+	return false;
+}
 
-		uint32_t target;
-		jobj_binary(job, "target", &target, 4);
-		if(rpc2_target != target) {
-			float hashrate = 0.;
-			pthread_mutex_lock(&stats_lock);
-			//for (size_t i = 0; i < opt_n_threads; i++)
-			//    hashrate += thr_hashrates[i];
-			pthread_mutex_unlock(&stats_lock);
+/*
+ * Proxy mode (proxy.c) serves the upstream job and scratchpad to local
+ * miners through the helpers below.
+ */
 
-			double difficulty = (((double) 0xffffffff) / target);
-			applog(LOG_INFO, "Pool set diff to %.0f", difficulty);
-			rpc2_target = target;
-		}
+static json_t *hi_json(const struct scratchpad_hi *hi)
+{
+	json_t *val = json_object();
+	char *id = bin2hex(hi->prevhash, 32);
 
-		if (rpc2_job_id) {
-			free(rpc2_job_id);
-		}
-		rpc2_job_id = strdup(job_id);
+	json_object_set_new(val, "height", json_integer(hi->height));
+	json_object_set_new(val, "block_id", json_string(id));
+	free(id);
+	return val;
+}
+
+/*
+ * The current job as a "job" object: blob with its top nonce byte set to
+ * nonce_prefix, plus the addendums that take a scratchpad at *hi to ours.
+ * *hi is updated to the height the addendums lead to. NULL if there is no
+ * job yet.
+ */
+json_t *proxy_job_json(uint8_t nonce_prefix, struct scratchpad_hi *hi)
+{
+	unsigned char blob[128];
+	json_t *val, *addms;
+	char *hex;
+	size_t i, n;
+	uint64_t off;
+
+	pthread_mutex_lock(&rpc2_job_lock);
+	if(!rpc2_bloblen || !rpc2_job_id[0])
+	{
 		pthread_mutex_unlock(&rpc2_job_lock);
+		return NULL;
 	}
-	if(work)
+	memcpy(blob, rpc2_blob, rpc2_bloblen);
+	blob[8] = nonce_prefix;
+	val = json_object();
+	hex = bin2hex(blob, rpc2_bloblen);
+	json_object_set_new(val, "blob", json_string(hex));
+	free(hex);
+	json_object_set_new(val, "job_id", json_string(rpc2_job_id));
+	hex = bin2hex((const unsigned char *)&rpc2_target, 4);
+	json_object_set_new(val, "target", json_string(hex));
+	free(hex);
+	pthread_mutex_unlock(&rpc2_job_lock);
+
+	pthread_mutex_lock(&scratchpad_lock);
+	n = ARRAY_SIZE(add_arr);
+	for(i = 0; i < n && add_arr[i].prev_hi.height; i++)
 	{
-		if (!rpc2_blob) {
-			applog(LOG_ERR, "Requested work before work was received");
-			goto err_out;
+		if(add_arr[i].prev_hi.height == hi->height && !memcmp(add_arr[i].prev_hi.prevhash, hi->prevhash, 32))
+			break;
+	}
+	if(hi->height != current_scratchpad_hi.height && i < n && add_arr[i].prev_hi.height)
+	{
+		/* addendum k sits right after the data of k-1; the last one ends the scratchpad */
+		size_t first = i, last;
+		for(last = first; last + 1 < n && add_arr[last + 1].prev_hi.height; last++);
+		off = scratchpad_size;
+		for(i = last + 1; i-- > first;)
+			off -= add_arr[i].add_size;
+
+		addms = json_array();
+		for(i = first; i <= last; i++)
+		{
+			json_t *addm = json_object();
+			const struct scratchpad_hi *next = i < last ? &add_arr[i + 1].prev_hi : &current_scratchpad_hi;
+
+			json_object_set_new(addm, "hi", hi_json(next));
+			hex = bin2hex(add_arr[i].prev_hi.prevhash, 32);
+			json_object_set_new(addm, "prev_id", json_string(hex));
+			free(hex);
+			hex = bin2hex((const unsigned char *)&pscratchpad_buff[off], add_arr[i].add_size * 8);
+			json_object_set_new(addm, "addm", json_string(hex));
+			free(hex);
+			off += add_arr[i].add_size;
+			json_array_append_new(addms, addm);
 		}
-		memcpy(work->data, rpc2_blob, rpc2_bloblen);
-		memset(work->target, 0xff, sizeof(work->target));
-		//*((uint64_t*)&work->target[6]) = rpc2_target;
-		work->target[7] = rpc2_target;
+		json_object_set_new(val, "addms", addms);
+		*hi = current_scratchpad_hi;
+	}
+	else if(hi->height && hi->height != current_scratchpad_hi.height)
+		applog(LOG_WARNING, "proxy: no addendum history from height %llu, miner needs a full scratchpad",
+			(unsigned long long)hi->height);
+	pthread_mutex_unlock(&scratchpad_lock);
 
-		if (work->job_id)
-			free(work->job_id);
-		work->job_id = strdup(rpc2_job_id);
-		stratum_have_work = true;
+	return val;
+}
+
+/*
+ * getfullscratchpad result for a local miner; *hi is set to its height.
+ * Only the copy is made under scratchpad_lock, the hex encoding of a
+ * scratchpad this size would hold up addendums for too long.
+ */
+json_t *proxy_scratchpad_json(struct scratchpad_hi *hi)
+{
+	struct scratchpad_hi snap_hi;
+	unsigned char *snap = NULL, *p;
+	size_t len, snap_len = 0;
+	json_t *val;
+	char *hex;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&scratchpad_lock);
+		len = scratchpad_size * 8;
+		if(len && len <= snap_len)
+		{
+			memcpy(snap, pscratchpad_buff, len);
+			snap_hi = current_scratchpad_hi;
+		}
+		pthread_mutex_unlock(&scratchpad_lock);
+		if(!len || len <= snap_len)
+			break;
+		/* grown meanwhile (or first pass): make room outside the lock */
+		p = realloc(snap, len);
+		if(!p)
+		{
+			applog(LOG_ERR, "proxy: out of memory for a %zu byte scratchpad copy", len);
+			len = 0;
+			break;
+		}
+		snap = p;
+		snap_len = len;
+	}
+	if(!len)
+	{
+		free(snap);
+		return NULL;
 	}
-	UpdateScratchpad(opt_n_threads);
-	return true;
 
-err_out:
-	return false;
+	val = json_object();
+	json_object_set_new(val, "status", json_string("OK"));
+	hex = bin2hex(snap, len);
+	free(snap);
+	json_object_set_new(val, "scratchpad_hex", json_string(hex));
+	free(hex);
+	json_object_set_new(val, "hi", hi_json(&snap_hi));
+	*hi = snap_hi;
+
+	return val;
 }
 
 static bool work_decode(const json_t *val, struct work *work) {
@@ -864,6 +1290,7 @@ err_out: return false;
 
 bool rpc2_getfullscratchpad_decode(const json_t *val) {
 	const char *status;
+	size_t i;
 
 	json_t *res = json_object_get(val, "result");
 	if(!res) {
@@ -890,50 +1317,118 @@ bool rpc2_getfullscratchpad_decode(const json_t *val) {
 		goto err_out;
 	}
 
-	size_t len = hex2bin_len((unsigned char*)pscratchpad_buff, scratch_hex, WILD_KECCAK_SCRATCHPAD_BUFFSIZE);
-	if (!len)
-	{
-		applog(LOG_ERR, "JSON scratch_hex is not valid hex");
+	//parse hi
+	struct scratchpad_hi new_hi;
+	json_t *hi = json_object_get(res, "hi");
+	if(!hi) {
+		applog(LOG_ERR, "JSON inval hi");
 		goto err_out;
 	}
 
-	if (len%8 || len%32)
+	if(!parse_height_info(hi, &new_hi))
 	{
-		applog(LOG_ERR, "JSON scratch_hex is not valid size=%d bytes", len);
+		applog(LOG_ERR, "JSON inval hi, failed to parse");
 		goto err_out;
 	}
 
-
-	//parse hi
-	json_t *hi = json_object_get(res, "hi");
-	if(!hi) {
-		applog(LOG_ERR, "JSON inval hi");
+	size_t len = strlen(scratch_hex) / 2;
+	if (!len || len > WILD_KECCAK_SCRATCHPAD_BUFFSIZE || len%8 || len%32)
+	{
+		applog(LOG_ERR, "JSON scratch_hex is not valid size=%zu bytes", len);
 		goto err_out;
 	}
-
-	if(!parse_height_info(hi, &current_scratchpad_hi))
+	/* checked up front, so that a bad reply leaves the scratchpad alone */
+	for (i = 0; scratch_hex[i]; i++)
+		if (!isxdigit((unsigned char) scratch_hex[i]))
+			break;
+	if (i != len * 2)
 	{
-		applog(LOG_ERR, "JSON inval hi, failed to parse");
+		applog(LOG_ERR, "JSON scratch_hex is not valid hex");
 		goto err_out;
 	}
 
-	applog(LOG_INFO, "Fetched scratchpad size %d bytes", len);
+	/* data, size and height change together, the generation last */
+	pthread_mutex_lock(&scratchpad_lock);
+	hex2bin_len((unsigned char *) pscratchpad_buff, scratch_hex, len);
 	scratchpad_size = len/8;
+	current_scratchpad_hi = new_hi;
+	scratchpad_generation++;
+	pthread_mutex_unlock(&scratchpad_lock);
+
+	applog(LOG_INFO, "Fetched scratchpad size %zu bytes", len);
+	work_avail_notify();
 
 	return true;
 
-err_out: return false;
+err_out:
+	return false;
 }
 
-static void share_result(int result, struct work *work, const char *reason)
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* a finished batch of thr_id: hashes since start */
+static void thr_stats_add(int thr_id, unsigned long hashes, const struct timeval *start)
 {
+	struct thr_stats *st = &thr_stats[thr_id];
+	uint64_t now = now_us(), began = (uint64_t) start->tv_sec * 1000000 + start->tv_usec;
+	double dt, rate;
 	int i;
-	char s[256];
-	double hashrate = 0.0;
 
-	pthread_mutex_lock(&stats_lock);
-	for(i = 0; i < opt_n_threads; ++i) hashrate += thr_hashrates[i];
-	pthread_mutex_unlock(&stats_lock);
+	if (now <= began)
+		return;
+	if (!st->ewma_us)
+	{
+		rate = hashes * 1e6 / (now - began);
+		for (i = 0; i < RATE_WINDOWS; i++)
+			st->ewma[i] = rate;
+	}
+	else
+	{
+		/* the whole time since the last batch counts, idle or not */
+		dt = (now - st->ewma_us) * 1e-6;
+		rate = hashes / dt;
+		for (i = 0; i < RATE_WINDOWS; i++)
+			st->ewma[i] += (1 - exp(-dt / rate_window_secs[i])) * (rate - st->ewma[i]);
+	}
+	st->ewma_us = now;
+	st->hashes += hashes;
+	st->scan_us += now - began;
+}
+
+/* summed hashrate of all threads: window -1 is the last scan, else an average */
+static double stats_hashrate(int window)
+{
+	uint64_t now = now_us(), since;
+	double rate = 0;
+	int i;
+
+	for (i = 0; i < opt_n_threads; i++)
+	{
+		if (window < 0)
+		{
+			rate += thr_stats[i].last;
+			continue;
+		}
+		since = thr_stats[i].ewma_us;
+		/* a second of slack for the batch in progress */
+		if (since && now > since + 1000000)
+			rate += thr_stats[i].ewma[window] * exp(-((double) (now - since) - 1e6) * 1e-6 / rate_window_secs[window]);
+		else
+			rate += thr_stats[i].ewma[window];
+	}
+	return rate;
+}
+
+static void share_result(int result, struct work *work, const char *reason)
+{
+	char s[256];
+	double hashrate = stats_hashrate(0);
 
 	result ? ++accepted_count : ++rejected_count;
 
@@ -942,33 +1437,266 @@ static void share_result(int result, struct work *work, const char *reason)
 			100. * accepted_count / (accepted_count + rejected_count), s, result ? "(yay!!!)" : "(booooo)");
 }
 
-static bool submit_upstream_work(CURL *curl, struct work *work)
+/*
+ * A found share, from the miner thread until the pool answers for it.
+ * Records come from a preallocated pool and carry everything the trip
+ * needs inline (workio command, request slot, job id and nonce), so a
+ * share reaches the socket without touching the heap. Only when all of
+ * them are in flight does one get allocated.
+ */
+struct share_rec {
+	struct workio_cmd wc;
+	struct stratum_request req;
+	uint32_t data[32];
+	char job_id[64];
+	char nonce[17];
+	struct timeval sent;
+	bool heap;
+	struct share_rec *next;
+};
+
+#define SHARE_POOL_SIZE 64
+
+static struct share_rec share_pool[SHARE_POOL_SIZE];
+static struct share_rec *share_free;
+static int share_pool_used;
+static pthread_mutex_t share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct share_rec *share_get(void)
+{
+	struct share_rec *share;
+
+	pthread_mutex_lock(&share_lock);
+	if((share = share_free))
+		share_free = share->next;
+	else if(share_pool_used < SHARE_POOL_SIZE)
+		share = &share_pool[share_pool_used++];
+	pthread_mutex_unlock(&share_lock);
+
+	if(!share && (share = calloc(1, sizeof(*share))))
+		share->heap = true;
+	return share;
+}
+
+static void share_release(struct share_rec *share)
 {
-	char s[JSON_BUF_LEN], hash[32], *noncestr, *hashhex;
-	uint32_t nonce;
+	if(share->heap)
+	{
+		free(share);
+		return;
+	}
+	pthread_mutex_lock(&share_lock);
+	share->next = share_free;
+	share_free = share;
+	pthread_mutex_unlock(&share_lock);
+}
 
-	// pass if the previous hash is not the current previous hash
-	if(!submit_old && memcmp(work->data + 1 + 8, g_work.data + 1 + 8, 32)) return true;
+/*
+ * Shares found while no pool session was usable. They are handed back to
+ * the workio thread after the next login, which drops those whose block
+ * has passed meanwhile.
+ */
+#define SHARE_BACKLOG_MAX 32
 
+static struct share_rec *share_backlog, **share_backlog_tail = &share_backlog;
+static int share_backlog_len;
 
-	noncestr = bin2hex(((const unsigned char*)work->data) + 1, 8);
-	strcpy(last_found_nonce, noncestr);
-	wild_keccak_hash_dbl((uint8_t *)hash, (uint8_t *)work->data);
-	hashhex = bin2hex(hash, 32);
-	snprintf(s, JSON_BUF_LEN, "{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":1}\r\n", rpc2_id, work->job_id, noncestr, hashhex);
+static void share_stale(struct share_rec *share)
+{
+	__sync_fetch_and_add(&stale_count, 1);
+	if(opt_debug)
+		applog(LOG_DEBUG, "share %s (job %s) is stale, discarded", share->nonce, share->job_id);
+	share_release(share);
+}
 
-	free(hashhex);
-	free(noncestr);
+static void share_backlog_push(struct share_rec *share)
+{
+	struct share_rec *oldest = NULL;
 
-	if(unlikely(!stratum_send_line(&stratum, s)))
+	pthread_mutex_lock(&share_lock);
+	if(share_backlog_len == SHARE_BACKLOG_MAX)
 	{
-		applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
-		return(false);
+		oldest = share_backlog;
+		if(!(share_backlog = oldest->next))
+			share_backlog_tail = &share_backlog;
+		share_backlog_len--;
+	}
+	share->next = NULL;
+	*share_backlog_tail = share;
+	share_backlog_tail = &share->next;
+	share_backlog_len++;
+	pthread_mutex_unlock(&share_lock);
+
+	if(oldest)
+		share_stale(oldest);
+}
+
+static void share_backlog_replay(void)
+{
+	struct share_rec *share;
+	int n;
+
+	pthread_mutex_lock(&share_lock);
+	share = share_backlog;
+	n = share_backlog_len;
+	share_backlog = NULL;
+	share_backlog_tail = &share_backlog;
+	share_backlog_len = 0;
+	pthread_mutex_unlock(&share_lock);
+
+	if(n)
+		applog(LOG_INFO, "resubmitting %d share%s found while the pool was away", n, n > 1 ? "s" : "");
+	while(share)
+	{
+		struct share_rec *next = share->next;
+
+		if(!tq_push(thr_info[work_thr_id].q, &share->wc))
+			share_release(share);
+		share = next;
+	}
+}
+
+/*
+ * Submit params for the current session and job, with the nonce and hash
+ * left to be filled in place. Rebuilt only when either changes; used by
+ * the workio thread only.
+ */
+static char share_tmpl[SUBMIT_LINE_MAX];
+static char share_tmpl_id[sizeof(rpc2_id)];
+static char share_tmpl_job[64];
+static int share_tmpl_nonce, share_tmpl_result;
+
+static const char *share_params(const struct share_rec *share, const unsigned char *hash)
+{
+	char hex[65];
+
+	if(strcmp(share_tmpl_id, rpc2_id) || strcmp(share_tmpl_job, share->job_id) || !share_tmpl[0])
+	{
+		strcpy(share_tmpl_id, rpc2_id);
+		strcpy(share_tmpl_job, share->job_id);
+		share_tmpl_nonce = snprintf(share_tmpl, sizeof(share_tmpl),
+			"{\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"", rpc2_id, share->job_id);
+		share_tmpl_result = share_tmpl_nonce + 16 + sizeof("\", \"result\": \"") - 1;
+		snprintf(share_tmpl + share_tmpl_nonce, sizeof(share_tmpl) - share_tmpl_nonce,
+			"%016d\", \"result\": \"%064d\"}", 0, 0);
+	}
+	memcpy(share_tmpl + share_tmpl_nonce, share->nonce, 16);
+	bin2hex_str(hex, hash, 32);
+	memcpy(share_tmpl + share_tmpl_result, hex, 64);
+	return share_tmpl;
+}
+
+#define SUBMIT_TIMEOUT 60
+
+static void restart_threads(void);
+
+static void submit_reply(struct stratum_ctx *sctx, const struct stratum_status *st, void *arg)
+{
+	struct share_rec *share = arg;
+	const char *reason = NULL;
+	struct timeval now, diff;
+	bool valid;
+
+	if(st && st->lost)
+	{
+		/* the connection went away with the share: send it again */
+		share_backlog_push(share);
+		return;
+	}
+	if(!st)
+	{
+		applog(LOG_ERR, "share %s (job %s): no reply from pool", share->nonce, share->job_id);
+		share_result(false, NULL, "no reply");
+		share_release(share);
+		return;
+	}
+
+	valid = !st->error && (!st->status || !strcmp(st->status, "OK"));
+	reason = st->error;
+	if(reason && !strcmp(reason, "Unauthenticated"))
+	{
+		/* a late reply on a pool we already left says nothing
+		 * about the current session; otherwise log in again and
+		 * give the share another try. The miners keep hashing. */
+		pthread_mutex_lock(&session_lock);
+		if(!sctx->standby && sctx == stratum)
+		{
+			applog(LOG_ERR, "Response returned \"Unauthenticated\", need to relogin");
+			strcpy(rpc2_id, "");
+		}
+		pthread_mutex_unlock(&session_lock);
+		share_backlog_push(share);
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, &share->sent);
+	if(!valid)
+		applog(LOG_INFO, "share %s (job %s) rejected: %s", share->nonce, share->job_id,
+			reason ? reason : "unknown");
+	else if(opt_debug)
+		applog(LOG_DEBUG, "share %s (job %s) accepted in %ld ms", share->nonce, share->job_id,
+			(long)(diff.tv_sec * 1000 + diff.tv_usec / 1000));
+
+	share_result(valid, NULL, reason);
+	share_release(share);
+}
+
+/* sends a share; it is released once the pool answers, or here if stale */
+static bool submit_upstream_work(CURL *curl, struct share_rec *share)
+{
+	unsigned char hash[32];
+	bool sent;
+
+	bin2hex_str(share->nonce, ((const unsigned char*)share->data) + 1, 8);
+
+	// pass if the previous hash is not the current previous hash
+	if(!submit_old && memcmp(share->data + 1 + 8, g_work.data + 1 + 8, 32))
+	{
+		share_stale(share);
+		return true;
+	}
+
+	strcpy(last_found_nonce, share->nonce);
+	wild_keccak_hash_dbl((uint8_t *)hash, (uint8_t *)share->data);
+	gettimeofday(&share->sent, NULL);
+
+	/* no usable session: hold the share until the next login. The lock
+	 * keeps a pool switch from pairing one pool with another's session id */
+	pthread_mutex_lock(&session_lock);
+	sent = strcmp(rpc2_id, "")
+		&& stratum_submit(stratum, &share->req, share_params(share, hash), SUBMIT_TIMEOUT, submit_reply, share);
+	pthread_mutex_unlock(&session_lock);
+	if(unlikely(!sent))
+	{
+		if(opt_debug)
+			applog(LOG_DEBUG, "share %s (job %s) queued until the pool is back", share->nonce, share->job_id);
+		share_backlog_push(share);
 	}
 
 	return(true);
 }
 
+/* forwards a local miner's share through the active upstream session */
+bool proxy_submit_upstream(const char *job_id, const char *nonce, const char *result,
+			   stratum_status_cb cb, void *arg)
+{
+	char s[JSON_BUF_LEN];
+	bool ret = false;
+
+	if(!have_stratum)
+		return false;
+	pthread_mutex_lock(&session_lock);
+	if(strcmp(rpc2_id, ""))
+	{
+		snprintf(s, JSON_BUF_LEN, "{\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}",
+			rpc2_id, job_id, nonce, result);
+		ret = stratum_submit(stratum, NULL, s, SUBMIT_TIMEOUT, cb, arg) != 0;
+	}
+	pthread_mutex_unlock(&session_lock);
+	return ret;
+}
+
 static const char *rpc_req = "{\"method\": \"getwork\", \"params\": [], \"id\":0}\r\n";
 
 static bool get_upstream_work(CURL *curl, struct work *work)
@@ -1011,11 +1739,10 @@ static bool rpc2_login(CURL *curl)
 
 static void workio_cmd_free(struct workio_cmd *wc)
 {
+	/* submit commands live in their share record, which the share's
+	 * own path releases */
 	if(wc->cmd == WC_SUBMIT_WORK)
-	{
-		work_free(wc->u.work);
-		free(wc->u.work);
-	}
+		return;
 
 	free(wc);
 }
@@ -1053,11 +1780,12 @@ static bool workio_submit_work(struct workio_cmd *wc, CURL *curl)
 	int failures = 0;
 
 	// submit solution to bitcoin via JSON-RPC
-	while(!submit_upstream_work(curl, wc->u.work))
+	while(!submit_upstream_work(curl, wc->u.share))
 	{
 		if(unlikely((opt_retries >= 0) && (++failures > opt_retries)))
 		{
 			applog(LOG_ERR, "...terminating workio thread");
+			share_release(wc->u.share);
 			return(false);
 		}
 
@@ -1102,6 +1830,7 @@ static void *workio_thread(void *userdata)
 	char ok = true;
 	CURL *curl;
 
+	place_service_thread();
 	curl = curl_easy_init();
 
 	while(likely(ok))
@@ -1158,26 +1887,47 @@ static bool get_work(struct thr_info *thr, struct work *work)
 
 static bool submit_work(struct thr_info *thr, const struct work *work_in)
 {
-	struct workio_cmd *wc;
+	struct share_rec *share = share_get();
 
-	/* fill out work request message */
-	wc = calloc(1, sizeof(*wc));
-	wc->u.work = malloc(sizeof(*work_in));
+	if(!share)
+		return(false);
 
-	wc->cmd = WC_SUBMIT_WORK;
-	wc->thr = thr;
-	work_copy(wc->u.work, work_in);
+	/* fill out work request message */
+	share->wc.cmd = WC_SUBMIT_WORK;
+	share->wc.thr = thr;
+	share->wc.u.share = share;
+	memcpy(share->data, work_in->data, sizeof(share->data));
+	snprintf(share->job_id, sizeof(share->job_id), "%s", work_in->job_id ? work_in->job_id : "");
 
 	/* send solution to workio thread */
-	if(!tq_push(thr_info[work_thr_id].q, wc))
+	if(!tq_push(thr_info[work_thr_id].q, &share->wc))
 	{
-		workio_cmd_free(wc);
+		share_release(share);
 		return(false);
 	}
 
 	return(true);
 }
 
+/* blocks until the scratchpad is loaded and warmed up; always true so it
+ * can sit in a chain of connect/login steps */
+static bool scratchpad_wait_ready(void)
+{
+	pthread_mutex_lock(&scratchpad_ready_lock);
+	while(!scratchpad_ready)
+		pthread_cond_wait(&scratchpad_ready_cond, &scratchpad_ready_lock);
+	pthread_mutex_unlock(&scratchpad_ready_lock);
+	return true;
+}
+
+static void scratchpad_set_ready(void)
+{
+	pthread_mutex_lock(&scratchpad_ready_lock);
+	scratchpad_ready = true;
+	pthread_cond_broadcast(&scratchpad_ready_cond);
+	pthread_mutex_unlock(&scratchpad_ready_lock);
+}
+
 static inline void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 {
 	pthread_mutex_lock(&sctx->work_lock);
@@ -1187,72 +1937,618 @@ static inline void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 	pthread_mutex_unlock(&sctx->work_lock);
 }
 
+/* nonces covered by one kernel launch */
+static uint32_t nonce_step(void)
+{
+	uint32_t step = CUDABlocks * CUDAThreads;
+
+	return step ? step : 1;
+}
+
+/* n rounded down to whole kernel launches, at least one */
+static uint32_t nonce_round(uint64_t n, uint32_t step)
+{
+	n -= n % step;
+	return n ? n : step;
+}
+
+static bool job_hazard_held(const struct job_pub *job)
+{
+	int i;
+
+	for (i = 0; i < opt_n_threads; i++)
+		if (job_hazards[i].job == job)
+			return true;
+	return false;
+}
+
+/* makes a copy of work the miners' current job; stratum thread only */
+static void job_publish(const struct work *work, const struct job_trace *trace,
+	struct stratum_ctx *sctx, unsigned int lane)
+{
+	uint8_t *nonce;
+
+	struct job_pub *job, *old, **pp;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+	{
+		applog(LOG_ERR, "job publish: out of memory");
+		return;
+	}
+	job->ranges = calloc(opt_n_threads, sizeof(*job->ranges));
+	if (!job->ranges)
+	{
+		applog(LOG_ERR, "job publish: out of memory");
+		free(job);
+		return;
+	}
+	work_copy(&job->work, work);
+	job->trace = *trace;
+	job->ctx = sctx;
+	job->gen = job_gen + 1;
+	job->lane = lane;
+	/* a new lane is no new job, lat_job_start was taken on lane 0 */
+	job->started = lane != 0;
+	nonce = (uint8_t *) job->work.data + 1;
+	nonce[4] = lane & 0xff;
+	nonce[5] = lane >> 8;
+	nonce[6] = opt_nonce_prefix;
+	/* whole kernel launches only, without wrapping past 2^32 */
+	job->nonce_end = 0x100000000ULL - nonce_step();
+	job->nonce_end -= job->nonce_end % nonce_step();
+
+	old = cur_job;
+	cur_job = job;
+	__sync_synchronize();
+	job_gen = job->gen;
+
+	if (old)
+	{
+		old->next = job_retired;
+		job_retired = old;
+	}
+	pp = &job_retired;
+	while (*pp)
+	{
+		old = *pp;
+		if (job_hazard_held(old))
+		{
+			pp = &old->next;
+			continue;
+		}
+		*pp = old->next;
+		work_free(&old->work);
+		free(old->ranges);
+		free(old);
+	}
+}
+
+/* the current job, protected from job_publish() until the next call */
+static struct job_pub *job_acquire(int thr_id)
+{
+	struct job_pub *job;
+
+	do {
+		job = cur_job;
+		job_hazards[thr_id].job = job;
+		__sync_synchronize();
+	} while (job != cur_job);
+	return job;
+}
+
+/*
+ * Gives thr_id's empty range up to want fresh nonces of job, fewer as the
+ * unclaimed part runs low so that the tail spreads over all miners. Once
+ * everything is handed out it steals the upper half of the largest range
+ * another miner has left. False when there is nothing worth taking.
+ */
+static bool nonce_refill(struct job_pub *job, int thr_id, uint64_t want)
+{
+	uint32_t step = nonce_step();
+	uint64_t next, left, n, r, best;
+	int i, victim;
+
+	do {
+		next = job->nonce_next;
+		if (next >= job->nonce_end)
+			break;
+		left = job->nonce_end - next;
+		n = left / (2 * opt_n_threads);
+		if (n > want)
+			n = want;
+		n = nonce_round(n, step);
+		if (n > left)
+			n = left;
+	} while (!__sync_bool_compare_and_swap(&job->nonce_next, next, next + n));
+	if (next < job->nonce_end)
+	{
+		job->ranges[thr_id].r = RANGE(next, next + n);
+		return true;
+	}
+
+	for (;;)
+	{
+		uint32_t pos, end, mid;
+
+		best = 0;
+		victim = -1;
+		for (i = 0; i < opt_n_threads; i++)
+		{
+			r = job->ranges[i].r;
+			if (i != thr_id && RANGE_LEFT(r) > RANGE_LEFT(best))
+			{
+				best = r;
+				victim = i;
+			}
+		}
+		if (victim < 0 || RANGE_LEFT(best) < 2 * step)
+			return false;
+		pos = RANGE_POS(best);
+		end = RANGE_END(best);
+		mid = end - nonce_round(RANGE_LEFT(best) / 2, step);
+		if (__sync_bool_compare_and_swap(&job->ranges[victim].r, best, RANGE(pos, mid)))
+		{
+			job->ranges[thr_id].r = RANGE(mid, end);
+			__sync_fetch_and_add(&nonce_steals, 1);
+			return true;
+		}
+	}
+}
+
+/* takes up to want nonces off the front of thr_id's own range */
+static bool nonce_slice(struct job_pub *job, int thr_id, uint64_t want,
+	uint32_t *first, uint32_t *max_nonce)
+{
+	struct nonce_range *mine = &job->ranges[thr_id];
+	uint64_t r;
+	uint32_t n;
+
+	do {
+		r = mine->r;
+		if (!RANGE_LEFT(r))
+			return false;
+		n = nonce_round(want, nonce_step());
+		if (n > RANGE_LEFT(r))
+			n = RANGE_LEFT(r);
+	} while (!__sync_bool_compare_and_swap(&mine->r, r, RANGE(RANGE_POS(r) + n, RANGE_END(r))));
+	*first = RANGE_POS(r);
+	*max_nonce = RANGE_POS(r) + n;
+	return true;
+}
+
+/* hands the unscanned tail of the last slice, from pos on, back to the range */
+static void nonce_unget(struct job_pub *job, int thr_id, uint32_t pos)
+{
+	struct nonce_range *mine = &job->ranges[thr_id];
+	uint64_t r;
+
+	do {
+		r = mine->r;
+		if (pos >= RANGE_POS(r))
+			return;
+	} while (!__sync_bool_compare_and_swap(&mine->r, r, RANGE(pos, RANGE_END(r))));
+}
+
+/*
+ * Co-tenant throttle, --throttle / --throttle-load. Every THROTTLE_INTERVAL
+ * the controller reads the host's CPU and memory pressure (PSI some avg10),
+ * the load average and our cgroup's CPU quota. While over budget it parks a
+ * miner thread per tick and, with one left, shortens its duty cycle; after
+ * THROTTLE_CALM_TICKS calm ticks in a row it gives back duty cycle first and
+ * threads after. Each change is left to settle for THROTTLE_SETTLE_TICKS.
+ * Parked miners wait on work_avail_cond, the others sleep
+ * (1000 - duty) / duty of each batch's time after it.
+ */
+#define THROTTLE_INTERVAL	2
+#define THROTTLE_CALM_TICKS	3
+#define THROTTLE_SETTLE_TICKS	4	/* for avg10 to catch up after a change */
+#define THROTTLE_DUTY_MIN	50	/* permille */
+
+struct throttle_state {
+	double psi_mem, psi_cpu;	/* percent, -1 without PSI */
+	double load1;
+	double cgroup_cpus;		/* quota, 0 when unlimited */
+	int calm, settle;
+	unsigned long backoffs, restores;
+};
+
+static struct throttle_state throttle;
+static volatile int throttle_active;		/* miners below this hash */
+static volatile int throttle_duty = 1000;	/* permille */
+
+static bool throttle_enabled(void)
+{
+	return opt_throttle_psi || opt_throttle_load > 0;
+}
+
+/* "some avg10" of /proc/pressure/what, -1 without PSI */
+static double psi_some_avg10(const char *what)
+{
+	char path[64];
+	double v = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/pressure/%s", what);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "some avg10=%lf", &v) != 1)
+		v = -1;
+	fclose(fp);
+	return v;
+}
+
+static double loadavg1(void)
+{
+	double v = 0;
+	FILE *fp = fopen("/proc/loadavg", "r");
+
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%lf", &v) != 1)
+		v = 0;
+	fclose(fp);
+	return v;
+}
+
+/* CPUs our cgroup may use (cgroup v2 cpu.max or v1 CFS quota), 0 if unlimited */
+static double cgroup_cpu_limit(void)
+{
+	char line[512], path[640], *cg = NULL, *v1 = NULL;
+	long long quota, period;
+	FILE *fp;
+
+	fp = fopen("/proc/self/cgroup", "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		/* "hierarchy:controllers:path", v2 is "0::path" */
+		char *ctrl = strchr(line, ':'), *cgpath, *tok, *save;
+
+		if (!ctrl || !(cgpath = strchr(ctrl + 1, ':')))
+			continue;
+		*ctrl++ = '\0';
+		*cgpath++ = '\0';
+		cgpath[strcspn(cgpath, "\n")] = '\0';
+		if (!strcmp(line, "0") && !*ctrl) {
+			if (!cg)
+				cg = strdup(cgpath);
+			continue;
+		}
+		for (tok = strtok_r(ctrl, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+			if (!strcmp(tok, "cpu") && !v1)
+				v1 = strdup(cgpath);
+	}
+	fclose(fp);
+
+	quota = period = 0;
+	if (cg) {
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cg);
+		fp = fopen(path, "r");
+		if (fp) {
+			/* "max 100000" when unlimited */
+			if (fscanf(fp, "%lld %lld", &quota, &period) != 2)
+				quota = 0;
+			fclose(fp);
+		}
+	}
+	if (!period && v1) {
+		snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_quota_us", v1);
+		fp = fopen(path, "r");
+		if (fp) {
+			if (fscanf(fp, "%lld", &quota) != 1)
+				quota = 0;
+			fclose(fp);
+		}
+		snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_period_us", v1);
+		fp = fopen(path, "r");
+		if (fp) {
+			if (fscanf(fp, "%lld", &period) != 1)
+				period = 0;
+			fclose(fp);
+		}
+	}
+	free(cg);
+	free(v1);
+	return (quota > 0 && period > 0) ? (double) quota / period : 0;
+}
+
+static void throttle_tick(void)
+{
+	struct throttle_state *t = &throttle;
+	int active = throttle_active, duty = throttle_duty, cap = opt_n_threads;
+	double load, psi;
+	bool over, calm;
+
+	t->psi_mem = psi_some_avg10("memory");
+	t->psi_cpu = psi_some_avg10("cpu");
+	t->load1 = loadavg1();
+	t->cgroup_cpus = cgroup_cpu_limit();
+	load = t->load1 / (num_processors > 0 ? num_processors : 1);
+	psi = t->psi_mem > t->psi_cpu ? t->psi_mem : t->psi_cpu;
+	/* no more hashing threads than the quota has CPUs for */
+	if (t->cgroup_cpus > 0 && cap > ceil(t->cgroup_cpus))
+		cap = ceil(t->cgroup_cpus);
+
+	over = (opt_throttle_psi && psi > opt_throttle_psi)
+		|| (opt_throttle_load > 0 && load > opt_throttle_load) || active > cap;
+	calm = !over && (!opt_throttle_psi || psi < opt_throttle_psi / 2.)
+		&& (opt_throttle_load <= 0 || load < opt_throttle_load * 0.8);
+	t->calm = calm ? t->calm + 1 : 0;
+	if (t->settle && active <= cap) {
+		t->settle--;
+		return;
+	}
+
+	if (over) {
+		if (active > cap)
+			active = cap;
+		else if (active > 1)
+			active--;
+		else
+			duty = duty * 7 / 10 > THROTTLE_DUTY_MIN ? duty * 7 / 10 : THROTTLE_DUTY_MIN;
+	} else if (t->calm >= THROTTLE_CALM_TICKS) {
+		t->calm = 0;
+		if (duty < 1000)
+			duty = duty + 100 < 1000 ? duty + 100 : 1000;
+		else if (active < cap)
+			active++;
+	}
+	if (active == throttle_active && duty == throttle_duty)
+		return;
+
+	if (active < throttle_active || duty < throttle_duty)
+		t->backoffs++;
+	else
+		t->restores++;
+	applog(LOG_INFO, "throttle: pressure %.1f%%, load %.2f/CPU%s, %d of %d miners at %.0f%% duty",
+		psi, load, active >= cap && cap < opt_n_threads ? " (cgroup quota)" : "",
+		active, opt_n_threads, duty / 10.);
+	throttle_duty = duty;
+	throttle_active = active;
+	t->settle = THROTTLE_SETTLE_TICKS;
+	work_avail_notify();
+}
+
+static void *throttle_thread(void *userdata)
+{
+	place_service_thread();
+	for (;;) {
+		sleep(THROTTLE_INTERVAL);
+		throttle_tick();
+	}
+	return NULL;
+}
+
+/* the idle part of the duty cycle after a batch of batch_us, cut short by a restart */
+static void throttle_idle(int thr_id, uint64_t batch_us)
+{
+	int duty = throttle_duty;
+	uint64_t us, n;
+
+	if (duty >= 1000)
+		return;
+	for (us = batch_us * (1000 - duty) / duty; us && !work_restart[thr_id].restart; us -= n) {
+		n = us < 20000 ? us : 20000;
+		usleep(n);
+	}
+}
+
+/*
+ * Scan batch controller, one per miner thread: every scanhash call gets
+ * about --batch-ms worth of nonces at the smoothed hashrate, scaled down
+ * while the thread is slow to pick new jobs up and back up once it isn't.
+ */
+struct batch_ctl {
+	double rate;		/* hashes/s, EWMA over batches */
+	double scale;		/* BATCH_SCALE_MIN..1 */
+	uint64_t nonces;	/* last batch */
+	double ms;
+	uint64_t pickup_us;	/* last job publish -> hashing it */
+};
+
+#define BATCH_EWMA	0.25
+#define BATCH_SCALE_MIN	(1.0 / 16)
+
+static struct batch_ctl *batch_ctls;
+
+static uint64_t batch_size(struct batch_ctl *ctl)
+{
+	ctl->nonces = nonce_round(ctl->rate * ctl->scale * opt_batch_ms / 1000, nonce_step());
+	return ctl->nonces;
+}
+
+static void batch_done(struct batch_ctl *ctl, unsigned long hashes, const struct timeval *start)
+{
+	struct timeval now, diff;
+	double rate;
+
+	gettimeofday(&now, NULL);
+	if (timeval_subtract(&diff, &now, (struct timeval *) start) || !hashes)
+		return;
+	ctl->ms = diff.tv_sec * 1e3 + diff.tv_usec * 1e-3;
+	if (ctl->ms <= 0)
+		return;
+	rate = hashes * 1e3 / ctl->ms;
+	ctl->rate = ctl->rate ? ctl->rate + BATCH_EWMA * (rate - ctl->rate) : rate;
+}
+
+/* a job took us long to notice: halve the batches, else grow them back */
+static void batch_pickup(struct batch_ctl *ctl, const struct timeval *published)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	if (timeval_subtract(&diff, &now, (struct timeval *) published))
+		return;
+	ctl->pickup_us = (uint64_t) diff.tv_sec * 1000000 + diff.tv_usec;
+	if (ctl->pickup_us > 2000ULL * opt_batch_ms)
+	{
+		ctl->scale /= 2;
+		if (ctl->scale < BATCH_SCALE_MIN)
+			ctl->scale = BATCH_SCALE_MIN;
+	}
+	else if (ctl->scale < 1)
+	{
+		ctl->scale += 0.125;
+		if (ctl->scale > 1)
+			ctl->scale = 1;
+	}
+}
+
+/* true once the pool has been gone for longer than --outage-grace */
+static bool pool_outage_expired(void)
+{
+	time_t since = pool_offline_since;
+
+	return since && time(NULL) - since > opt_outage_grace;
+}
+
 static void *miner_thread(void *userdata)
 {
-	uint32_t max_nonce, end_nonce, *nonceptr;
+	uint32_t *nonceptr;
 	struct thr_info *mythr = userdata;
 	struct work work = { { 0 } };
-	struct sched_param param;
+	struct job_pub *job = NULL;
+	unsigned int work_gen = 0;
+	bool exhausted = false;
 	int thr_id = mythr->id;
-	int i;
+	struct batch_ctl *ctl = &batch_ctls[thr_id];
+	struct scan_results res;
 
-	end_nonce = 0xffffffffU / opt_n_threads * (thr_id + 1) - 0x20;
 	nonceptr = (uint32_t *)(((char *)work.data) + 1);
 
-	CUDASetDevice(thr_id);
+	place_miner_thread(thr_id);
+	if(throttle_enabled())
+		drop_policy();
+	scan_dev->attach(thr_id);
+	scratchpad_wait_ready();
 
 	for(;;)
 	{
-		int rc;
-		int64_t max64;
+		uint64_t chunk;
 		unsigned long hashes_done;
 		struct timeval tv_start, tv_end, diff;
+		bool paused = false;
 
-		if (!opt_benchmark)
-			while(!scratchpad_size || !stratum_have_work) sleep(1);
-
-		pthread_mutex_lock(&g_work_lock);
-
-		if(((*nonceptr) >= end_nonce) && (!memcmp(((uint8_t *)work.data) + 9, ((uint8_t *)g_work.data) + 9, 71))) stratum_gen_work(&stratum, &g_work);
+		if (!opt_benchmark || thr_id >= throttle_active)
+		{
+			pthread_mutex_lock(&work_avail_lock);
+			while(thr_id >= throttle_active || (!opt_benchmark && (!scratchpad_size || !job_gen
+				|| pool_outage_expired() || (exhausted && job_gen == work_gen))))
+			{
+				if(!paused && thr_id == 0 && pool_outage_expired())
+					applog(LOG_WARNING, "pool unreachable for over %d s, pausing until new work", opt_outage_grace);
+				paused = true;
+				pthread_cond_wait(&work_avail_cond, &work_avail_lock);
+			}
+			if(paused)
+				hist_record_since(&lat_wake, &work_avail_tv);
+			pthread_mutex_unlock(&work_avail_lock);
+		}
 
-		if(memcmp(((uint8_t *)work.data) + 9, ((uint8_t *)g_work.data) + 9, 71))
+		if(job_gen != work_gen)
 		{
-			work_free(&work);
-			work_copy(&work, &g_work);
-			nonceptr = (uint32_t *)(((char *)work.data) + 1);
-			*nonceptr = 0xFFFFFFFFU / opt_n_threads * thr_id;
+			job = job_acquire(thr_id);
+
+			if(!__sync_lock_test_and_set(&job->started, 1))
+				hist_record_since(&job->ctx->lat_job_start, &job->trace.published);
+			hist_record_since(&thr_traces[thr_id].notice, &job->trace.published);
+			if(job->trace.rx.tv_sec)
+				hist_record_since(&thr_traces[thr_id].total, &job->trace.rx);
+			/* only a job that had to wait for our batch says something about it */
+			if(!paused && !exhausted)
+				batch_pickup(ctl, &job->trace.published);
+
+			/* job_id stays the job's own, valid while we hold the hazard */
+			work = job->work;
+			work_gen = job->gen;
+			exhausted = false;
 		}
-		else ++(*nonceptr);
 
-		pthread_mutex_unlock(&g_work_lock);
 		work_restart[thr_id].restart = 0;
 
-		max64 = LP_SCANTIME * thr_hashrates[thr_id];
-		if(max64 <= 0) max64 = 0x1fffffLL;
-
-		if(*nonceptr + max64 > end_nonce) max_nonce = end_nonce;
-		else max_nonce = *nonceptr + max64;
+		/* ranges last about LP_SCANTIME, scanned a batch at a time */
+		chunk = LP_SCANTIME * ctl->rate;
 
 		hashes_done = 0;
 
 		gettimeofday(&tv_start, NULL);
-		rc = scanhash_wildkeccak(thr_id, work.data, work.target, max_nonce, &hashes_done);
+		while(!work_restart[thr_id].restart && thr_id < throttle_active)
+		{
+			uint32_t first, max_nonce;
+			int n, i;
+			unsigned long done = 0;
+			struct timeval tv_batch;
+
+			if(!nonce_slice(job, thr_id, batch_size(ctl), &first, &max_nonce))
+			{
+				if(hashes_done)
+					break;
+				if(nonce_refill(job, thr_id, chunk))
+					continue;
+				if(opt_benchmark)
+				{
+					job->nonce_next = 0;
+					continue;
+				}
+				if(!__sync_lock_test_and_set(&job->exhausted, 1) && job->lane < 0xffff)
+				{
+					/* the stratum thread moves everyone to the next lane */
+					job_lane_wanted = job->gen;
+					stratum_interrupt(job->ctx);
+				}
+				exhausted = true;
+				break;
+			}
+			*nonceptr = first;
+			gettimeofday(&tv_batch, NULL);
+			n = scan_dev->scan(thr_id, work.data, work.target, max_nonce, &done, &res);
+			batch_done(ctl, done, &tv_batch);
+			thr_stats_add(thr_id, done, &tv_batch);
+			hashes_done += done;
+			/* a full ring or a restart leaves part of the slice for later */
+			nonce_unget(job, thr_id, *nonceptr);
+			if(n)
+			{
+				__sync_fetch_and_add(&scan_candidates, res.count);
+				if(res.count > n)
+				{
+					__sync_fetch_and_add(&scan_dropped, res.count - n);
+					applog(LOG_WARNING, "GPU #%d: %u candidates in one batch, %u dropped", thr_id, res.count, res.count - n);
+				}
+				for(i = 0; i < n; i++)
+				{
+					*nonceptr = res.nonce[i];
+					if(!submit_work(mythr, &work))
+						goto out;
+				}
+			}
+			throttle_idle(thr_id, now_us() - ((uint64_t) tv_batch.tv_sec * 1000000 + tv_batch.tv_usec));
+		}
 		gettimeofday(&tv_end, NULL);
 
-		timeval_subtract(&diff, &tv_end, &tv_start);
-		if(likely(diff.tv_usec || diff.tv_sec))
+		if(!hashes_done)
 		{
-			float tmp = hashes_done / (diff.tv_sec + (diff.tv_usec * 1e-6));
-			pthread_mutex_lock(&stats_lock);
-			thr_hashrates[thr_id] = tmp;
-			pthread_mutex_unlock(&stats_lock);
+			if(exhausted && job->lane == 0xffff && __sync_bool_compare_and_swap(&job->exhausted, 1, 2))
+				applog(LOG_WARNING, "job %s: nonce space exhausted, waiting for the next one", job->work.job_id);
+			continue;
 		}
 
-		applog(LOG_INFO, "GPU #%d: %s: %lu hashes, %.2f kh/s", thr_id, devstrs[thr_id], hashes_done, 1e-3 * thr_hashrates[thr_id]);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+		if(likely(diff.tv_usec || diff.tv_sec))
+			thr_stats[thr_id].last = hashes_done / (diff.tv_sec + (diff.tv_usec * 1e-6));
 
-		if(rc && !submit_work(mythr, &work)) break;
+		if(opt_benchmark)
+			applog(LOG_INFO, "GPU #%d: %s: %lu hashes, %.2f kh/s [%s: %s] [cpu %s %d]", thr_id, devstrs[thr_id], hashes_done,
+				1e-3 * thr_stats[thr_id].last, hugepage_names[opt_hugepages], scratchpad_backing,
+				placement_names[opt_placement], thr_cpus ? thr_cpus[thr_id] : -1);
+		else
+			applog(LOG_INFO, "GPU #%d: %s: %lu hashes, %.2f kh/s", thr_id, devstrs[thr_id], hashes_done, 1e-3 * thr_stats[thr_id].last);
 	}
 
+out:
 	tq_freeze(mythr->q);
 	return(NULL);
 }
@@ -1266,69 +2562,593 @@ static void restart_threads(void)
 		work_restart[i].restart = 1;
 }
 
-bool store_scratchpad_to_file(bool do_fsync)
+/*
+ * Scratchpad persistence runs on its own thread so the stratum loop never
+ * waits on the disk: a save request only flags the writer, which copies a
+ * consistent generation of the scratchpad into a shadow buffer and then
+ * writes, optionally fsyncs and renames the copy into place. The copy takes
+ * scratchpad_lock one chunk at a time, so an addendum waits for at most one
+ * chunk; if the generation changes midway the copy starts over, and after
+ * SCRATCHPAD_SAVE_RETRIES the save is left to the next request.
+ */
+#define SCRATCHPAD_SAVE_CHUNK (8UL << 20)
+#define SCRATCHPAD_SAVE_RETRIES 3
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_cond = PTHREAD_COND_INITIALIZER;
+static bool save_pending = false, save_busy = false, save_fsync = false;
+static uint64_t saved_generation = 0;
+
+static void *save_buf_alloc(size_t len)
 {
-	FILE *fp;
-	char file_name_buff[PATH_MAX];
-	int ret;
+#if !defined(_WIN64) && !defined(_WIN32)
+	void *p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+#else
+	return malloc(len);
+#endif
+}
 
-	if(opt_algo != ALGO_WILD_KECCAK || !scratchpad_size) return true;
+static void save_buf_free(void *p, size_t len)
+{
+#if !defined(_WIN64) && !defined(_WIN32)
+	munmap(p, len);
+#else
+	free(p);
+#endif
+}
+
+static bool write_scratchpad_file(const uint8_t *buf, size_t len, bool do_fsync)
+{
+	char file_name_buff[PATH_MAX];
+	size_t off = 0;
+	int fd;
 
 	snprintf(file_name_buff, sizeof(file_name_buff), "%s.tmp", pscratchpad_local_cache);
 	unlink(file_name_buff);
-	fp = fopen(file_name_buff, "wbx");
-	if(fp == NULL)
+	fd = open(file_name_buff, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if(fd == -1)
 	{
 		applog(LOG_INFO, "failed to create file %s: %s", file_name_buff, strerror(errno));
 		return false;
 	}
 
-	struct scratchpad_file_header sf = {0};
-	memcpy(&sf.add_arr[0], &add_arr[0], sizeof(sf.add_arr));
-	sf.current_hi = current_scratchpad_hi;
-	sf.scratchpad_size = scratchpad_size;
-
-
+	while(off < len)
+	{
+		size_t n = (len - off < SCRATCHPAD_SAVE_CHUNK) ? len - off : SCRATCHPAD_SAVE_CHUNK;
+		ssize_t w = write(fd, buf + off, n);
 
-	if ((fwrite(&sf, sizeof(sf), 1, fp) != 1) ||
-		(fwrite(pscratchpad_buff, 8, scratchpad_size, fp) != scratchpad_size)) {
-			applog(LOG_ERR, "failed to write file %s: %s", file_name_buff, strerror(errno));
-			fclose(fp);
-			unlink(file_name_buff);
-			return false;
+		if(w < 0 && errno == EINTR) continue;
+		if(w <= 0) goto err_out;
+		off += w;
 	}
-	fflush(fp);
-	/*if (do_fsync) {
-		if (fsync(fileno(fp)) == -1) {
-			applog(LOG_ERR, "failed to fsync file %s: %s", file_name_buff, strerror(errno));
-			fclose(fp);
-			unlink(file_name_buff);
-			return false;
-		}
-	}*/
-	if (fclose(fp) == EOF) {
-		applog(LOG_ERR, "failed to write file %s: %s", file_name_buff, strerror(errno));
-		unlink(file_name_buff);
-		return false;
+	if(do_fsync && fsync(fd) == -1) goto err_out;
+	if(close(fd) == -1)
+	{
+		fd = -1;
+		goto err_out;
 	}
-	ret = rename(file_name_buff, pscratchpad_local_cache);
-	if (ret == -1) {
+
+	if(rename(file_name_buff, pscratchpad_local_cache) == -1)
+	{
 		applog(LOG_ERR, "failed to rename %s to %s: %s",
 			file_name_buff, pscratchpad_local_cache, strerror(errno));
 		unlink(file_name_buff);
 		return false;
 	}
-	applog(LOG_DEBUG, "saved scratchpad to %s (%zu+%zu bytes)", pscratchpad_local_cache,
-		sizeof(struct scratchpad_file_header), (size_t)scratchpad_size * 8);
+#if !defined(_WIN64) && !defined(_WIN32)
+	if(do_fsync)
+	{
+		/* make the rename itself durable */
+		char dir[PATH_MAX], *p;
+
+		snprintf(dir, sizeof(dir), "%s", pscratchpad_local_cache);
+		p = strrchr(dir, '/');
+		if(p)
+		{
+			*p = '\0';
+			fd = open(dir, O_RDONLY);
+			if(fd != -1)
+			{
+				fsync(fd);
+				close(fd);
+			}
+		}
+	}
+#endif
 	return true;
+
+err_out:
+	applog(LOG_ERR, "failed to write file %s: %s", file_name_buff, strerror(errno));
+	if(fd != -1) close(fd);
+	unlink(file_name_buff);
+	return false;
+}
+
+static void *scratchpad_save_thread(void *userdata)
+{
+	for(;;)
+	{
+		struct scratchpad_file_header fh, *sf;
+		struct timeval tv_start, tv_end, diff;
+		uint64_t gen = 0;
+		size_t len, off, n;
+		uint8_t *buf;
+		int attempt;
+		bool do_fsync, ok, done;
+
+		pthread_mutex_lock(&save_lock);
+		while(!save_pending)
+			pthread_cond_wait(&save_cond, &save_lock);
+		save_pending = false;
+		save_busy = true;
+		do_fsync = save_fsync;
+		pthread_mutex_unlock(&save_lock);
+
+		gettimeofday(&tv_start, NULL);
+		buf = NULL;
+		len = 0;
+		done = false;
+		for(attempt = 0; attempt < SCRATCHPAD_SAVE_RETRIES && !done; attempt++)
+		{
+			pthread_mutex_lock(&scratchpad_lock);
+			gen = scratchpad_generation;
+			memset(&fh, 0, sizeof(fh));
+			memcpy(&fh.add_arr[0], &add_arr[0], sizeof(fh.add_arr));
+			fh.current_hi = current_scratchpad_hi;
+			fh.scratchpad_size = scratchpad_size;
+			pthread_mutex_unlock(&scratchpad_lock);
+			if(!fh.scratchpad_size || gen == saved_generation) break;
+
+			if(buf && len != sizeof(fh) + fh.scratchpad_size * 8)
+			{
+				save_buf_free(buf, len);
+				buf = NULL;
+			}
+			if(!buf)
+			{
+				len = sizeof(fh) + fh.scratchpad_size * 8;
+				buf = save_buf_alloc(len);
+				if(!buf)
+				{
+					applog(LOG_ERR, "out of memory for scratchpad snapshot, wanted %zu", len);
+					break;
+				}
+			}
+			sf = (struct scratchpad_file_header *)buf;
+			*sf = fh;
+
+			/* a chunk at a time, starting over if the scratchpad moves on */
+			for(off = 0; off < fh.scratchpad_size * 8; off += n)
+			{
+				n = fh.scratchpad_size * 8 - off;
+				if(n > SCRATCHPAD_SAVE_CHUNK) n = SCRATCHPAD_SAVE_CHUNK;
+				pthread_mutex_lock(&scratchpad_lock);
+				if(scratchpad_generation != gen)
+				{
+					pthread_mutex_unlock(&scratchpad_lock);
+					break;
+				}
+				memcpy(buf + sizeof(*sf) + off, (uint8_t *)pscratchpad_buff + off, n);
+				pthread_mutex_unlock(&scratchpad_lock);
+			}
+			done = off >= fh.scratchpad_size * 8;
+		}
+		if(!done && buf && attempt == SCRATCHPAD_SAVE_RETRIES)
+			applog(LOG_DEBUG, "scratchpad kept changing, save deferred");
+
+		if(buf)
+		{
+			ok = done && write_scratchpad_file(buf, len, do_fsync);
+			save_buf_free(buf, len);
+			if(ok)
+			{
+				saved_generation = gen;
+				gettimeofday(&tv_end, NULL);
+				timeval_subtract(&diff, &tv_end, &tv_start);
+				applog(LOG_DEBUG, "saved scratchpad to %s (%zu+%zu bytes) in %.2f s", pscratchpad_local_cache,
+					sizeof(struct scratchpad_file_header), len - sizeof(*sf), diff.tv_sec + diff.tv_usec * 1e-6);
+			}
+		}
+
+		pthread_mutex_lock(&save_lock);
+		save_busy = false;
+		pthread_mutex_unlock(&save_lock);
+	}
+	return NULL;
 }
 
+/* asks the writer thread for a snapshot; never blocks on I/O. Returns false
+ * if a save is already in progress, so the caller can try again later. */
+static bool store_scratchpad_to_file(bool do_fsync)
+{
+	bool ret;
+
+	if(opt_algo != ALGO_WILD_KECCAK || !scratchpad_size) return true;
+
+	pthread_mutex_lock(&save_lock);
+	ret = !save_busy;
+	if(ret)
+	{
+		save_pending = true;
+		save_fsync = do_fsync;
+		pthread_cond_signal(&save_cond);
+	}
+	pthread_mutex_unlock(&save_lock);
+	return ret;
+}
+
+#if !defined(_WIN64) && !defined(_WIN32)
+/* Scratchpad warm-up: the buffer is first touched (and filled from the
+ * cache file) by one worker per chunk, each pinned to the NUMA node the
+ * chunk is interleaved onto, so its pages are allocated there instead of
+ * all on the node of whichever thread happened to fault them in. */
+#define SCRATCHPAD_WARMUP_MAX_THREADS 16
+
+struct warmup_chunk {
+	pthread_t	pth;
+	bool		started;
+	bool		ok;
+	int		err;		/* errno of a failed read */
+	int		node;
+	int		fd;
+	off_t		file_off;
+	uint8_t		*p;
+	size_t		len;		/* bytes in the chunk */
+	size_t		file_len;	/* of which are read from fd */
+};
+
+static int numa_node_count(void)
+{
+	int n = 0;
+#ifdef __linux
+	char path[64];
+
+	for(;;)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+		if(access(path, F_OK)) break;
+		n++;
+	}
+#endif
+	return n;
+}
+
+#ifdef __linux
+/* parse a sysfs cpulist such as "0-3,8-11" */
+static bool parse_cpulist(const char *s, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while(*s && *s != '\n')
+	{
+		char *ep;
+		long lo = strtol(s, &ep, 10), hi = lo;
+
+		if(ep == s) return false;
+		if(*ep == '-') hi = strtol(ep + 1, &ep, 10);
+		for(; lo <= hi && lo < CPU_SETSIZE; lo++) CPU_SET(lo, set);
+		s = (*ep == ',') ? ep + 1 : ep;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+static bool numa_node_cpus(int node, cpu_set_t *set)
+{
+	char path[64], buf[1024];
+	FILE *fp;
+	bool ret = false;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	fp = fopen(path, "r");
+	if(!fp) return false;
+	if(fgets(buf, sizeof(buf), fp)) ret = parse_cpulist(buf, set);
+	fclose(fp);
+	return ret;
+}
+#endif
+
+static void *scratchpad_warmup_worker(void *userdata)
+{
+	struct warmup_chunk *c = userdata;
+	size_t off = 0;
+
+#ifdef __linux
+	cpu_set_t set;
+	if(c->node >= 0 && numa_node_cpus(c->node, &set))
+		sched_setaffinity(0, sizeof(set), &set);
+#endif
+
+	while(off < c->file_len)
+	{
+		ssize_t n = pread(c->fd, c->p + off, c->file_len - off, c->file_off + off);
+		if(n <= 0)
+		{
+			/* a file shorter than its header says reads as EOF */
+			c->err = n ? errno : EIO;
+			c->ok = false;
+			return NULL;
+		}
+		off += n;
+	}
+
+	/* anything past the file data only needs to be faulted in */
+	for(off = (off + 4095) & ~4095UL; off < c->len; off += 4096)
+		c->p[off] = 0;
+
+	c->ok = true;
+	return NULL;
+}
+
+/* reads file_len bytes at file_off of fd into the scratchpad and prefaults
+ * the remainder of the buffer, in parallel; *err is a failed read's errno */
+static bool scratchpad_fill_parallel(int fd, off_t file_off, size_t file_len, int *err)
+{
+	struct warmup_chunk chunks[SCRATCHPAD_WARMUP_MAX_THREADS] = {{0}};
+	size_t sz = WILD_KECCAK_SCRATCHPAD_BUFFSIZE, chunk, off;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nodes = numa_node_count(), nthreads, n = 0, i;
+	struct timeval tv_start, tv_end, diff;
+	bool ok = true;
+
+	nthreads = ncpu < 1 ? 1 : (ncpu > SCRATCHPAD_WARMUP_MAX_THREADS ? SCRATCHPAD_WARMUP_MAX_THREADS : ncpu);
+	chunk = (sz / nthreads + scratchpad_page_size - 1) & ~(scratchpad_page_size - 1);
+
+	gettimeofday(&tv_start, NULL);
+	for(off = 0; off < sz; off += chunk, n++)
+	{
+		struct warmup_chunk *c = &chunks[n];
+
+		c->node = (nodes > 1) ? n % nodes : -1;
+		c->fd = fd;
+		c->file_off = file_off + off;
+		c->p = (uint8_t *)pscratchpad_buff + off;
+		c->len = (sz - off < chunk) ? sz - off : chunk;
+		c->file_len = (off >= file_len) ? 0 : ((file_len - off < c->len) ? file_len - off : c->len);
+		c->started = !pthread_create(&c->pth, NULL, scratchpad_warmup_worker, c);
+		if(!c->started) scratchpad_warmup_worker(c);
+	}
+	for(i = 0; i < n; i++)
+	{
+		if(chunks[i].started) pthread_join(chunks[i].pth, NULL);
+		if(!chunks[i].ok && ok)
+			*err = chunks[i].err;
+		ok &= chunks[i].ok;
+	}
+	gettimeofday(&tv_end, NULL);
+	timeval_subtract(&diff, &tv_end, &tv_start);
+
+	applog(LOG_INFO, "scratchpad warm-up: %zu MB (%zu MB from cache) by %d threads on %d NUMA node(s) in %.2f s",
+		sz >> 20, file_len >> 20, n, nodes ? nodes : 1, diff.tv_sec + diff.tv_usec * 1e-6);
+	return ok;
+}
+
+static bool scratchpad_read_body(FILE *fp, size_t len, int *err)
+{
+	return scratchpad_fill_parallel(fileno(fp), sizeof(struct scratchpad_file_header), len, err);
+}
+#else
+static bool scratchpad_read_body(FILE *fp, size_t len, int *err)
+{
+	if (fread(pscratchpad_buff, 1, len, fp) == len)
+		return true;
+	*err = ferror(fp) ? errno : EIO;
+	return false;
+}
+#endif
+
+/*
+ * Thread placement, --cpu-affinity. Each CPU this process may use gets its
+ * NUMA node, package, core and SMT sibling index from sysfs and the policy
+ * orders them: miner i is pinned to the i-th CPU of that order (wrapping
+ * around), the stratum and workio threads share whatever the miners left.
+ */
+#ifdef __linux
+struct cpu_topo {
+	int cpu, node, package, core;
+	int smt;	/* index among the core's siblings */
+	int rank;	/* index of the core within its node */
+};
+
+static int sysfs_cpu_int(int cpu, const char *what)
+{
+	char path[96];
+	FILE *fp;
+	int v = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+	fp = fopen(path, "r");
+	if(!fp) return 0;
+	if(fscanf(fp, "%d", &v) != 1) v = 0;
+	fclose(fp);
+	return v;
+}
+
+static int cpu_smt_index(int cpu)
+{
+	char path[96], buf[256];
+	cpu_set_t set;
+	FILE *fp;
+	int i, n = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	fp = fopen(path, "r");
+	if(!fp) return 0;
+	if(fgets(buf, sizeof(buf), fp) && parse_cpulist(buf, &set))
+		for(i = 0; i < cpu; i++)
+			n += CPU_ISSET(i, &set) != 0;
+	fclose(fp);
+	return n;
+}
+
+static int topo_cmp_compact(const void *a, const void *b)
+{
+	const struct cpu_topo *x = a, *y = b;
+
+	if(x->node != y->node) return x->node - y->node;
+	if(x->package != y->package) return x->package - y->package;
+	if(x->core != y->core) return x->core - y->core;
+	return x->smt - y->smt;
+}
+
+/* one CPU per core first, taking turns between the nodes */
+static int topo_cmp_spread(const void *a, const void *b)
+{
+	const struct cpu_topo *x = a, *y = b;
+
+	if(x->smt != y->smt) return x->smt - y->smt;
+	if(x->rank != y->rank) return x->rank - y->rank;
+	return x->node - y->node;
+}
+
+/* "0,4,1" style list of cpus[0..n), cut short when buf runs out */
+static void format_cpus(char *buf, size_t len, const int *cpus, int n)
+{
+	size_t off = 0;
+	int i;
+
+	buf[0] = '\0';
+	for(i = 0; i < n && off + 12 < len; i++)
+		off += snprintf(buf + off, len - off, "%s%d", i ? "," : "", cpus[i]);
+	if(i < n)
+		snprintf(buf + off, len - off, ",...");
+}
+
+static cpu_set_t service_cpus;
+static bool service_pinned;
+
+/* works out thr_cpus[] and service_cpus, before any thread is started */
+static void placement_init(void)
+{
+	struct cpu_topo *topo;
+	cpu_set_t allowed;
+	char mbuf[256], sbuf[256];
+	int *order, *left, ncpu = 0, nodes = numa_node_count(), n = 0, nleft = 0, i, j, cores = 0;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed))
+		CPU_ZERO(&allowed);
+	num_processors = CPU_COUNT(&allowed);
+	if(opt_placement == PLACE_NONE)
+		return;
+
+	topo = calloc(CPU_SETSIZE, sizeof(*topo));
+	order = calloc(CPU_SETSIZE, sizeof(*order));
+	left = calloc(CPU_SETSIZE, sizeof(*left));
+	thr_cpus = malloc(opt_n_threads * sizeof(*thr_cpus));
+	if(!topo || !order || !left || !thr_cpus)
+	{
+		applog(LOG_ERR, "cpu placement: out of memory");
+		goto err_out;
+	}
+
+	for(i = 0; i < CPU_SETSIZE; i++)
+	{
+		struct cpu_topo *t;
+
+		if(!CPU_ISSET(i, &allowed))
+			continue;
+		if(opt_placement == PLACE_MASK && !CPU_ISSET(i, &opt_placement_mask))
+			continue;
+		t = &topo[ncpu++];
+		t->cpu = i;
+		t->package = sysfs_cpu_int(i, "physical_package_id");
+		t->core = sysfs_cpu_int(i, "core_id");
+		t->smt = cpu_smt_index(i);
+		for(j = 0; j < nodes; j++)
+		{
+			cpu_set_t set;
+
+			if(numa_node_cpus(j, &set) && CPU_ISSET(i, &set))
+				t->node = j;
+		}
+	}
+	if(!ncpu)
+	{
+		applog(LOG_WARNING, "cpu placement: none of the requested CPUs is available, not pinning");
+		goto err_out;
+	}
+
+	qsort(topo, ncpu, sizeof(*topo), topo_cmp_compact);
+	for(i = 0; i < ncpu; i++)
+	{
+		if(i && topo[i].node == topo[i - 1].node && topo[i].package == topo[i - 1].package
+			&& topo[i].core == topo[i - 1].core)
+		{
+			topo[i].rank = topo[i - 1].rank;
+			continue;
+		}
+		topo[i].rank = (i && topo[i].node == topo[i - 1].node) ? topo[i - 1].rank + 1 : 0;
+		cores++;
+	}
+	if(opt_placement == PLACE_SPREAD)
+		qsort(topo, ncpu, sizeof(*topo), topo_cmp_spread);
+	for(i = 0; i < ncpu; i++)
+		if(opt_placement != PLACE_PHYSICAL || !topo[i].smt)
+			order[n++] = topo[i].cpu;
+
+	for(i = 0; i < opt_n_threads; i++)
+		thr_cpus[i] = order[i % n];
+
+	/* the miners' CPUs are taken, stratum and workio get the rest */
+	service_cpus = allowed;
+	for(i = 0; i < opt_n_threads && i < n; i++)
+		CPU_CLR(order[i], &service_cpus);
+	for(i = 0; i < CPU_SETSIZE; i++)
+		if(CPU_ISSET(i, &service_cpus))
+			left[nleft++] = i;
+	service_pinned = nleft > 0;
+
+	format_cpus(mbuf, sizeof(mbuf), thr_cpus, opt_n_threads);
+	format_cpus(sbuf, sizeof(sbuf), left, nleft);
+	applog(LOG_INFO, "cpu placement (%s): %d CPUs, %d cores, %d NUMA node(s); miners on %s, stratum/workio on %s",
+		placement_names[opt_placement], ncpu, cores, nodes ? nodes : 1, mbuf,
+		service_pinned ? sbuf : "any (none left over)");
+	if(opt_n_threads > n)
+		applog(LOG_WARNING, "cpu placement: %d miner threads on %d CPUs", opt_n_threads, n);
+	goto out;
+
+err_out:
+	free(thr_cpus);
+	thr_cpus = NULL;
+out:
+	free(topo);
+	free(order);
+	free(left);
+}
+
+static void place_miner_thread(int thr_id)
+{
+	if(thr_cpus)
+		affine_to_cpu(thr_id, thr_cpus[thr_id]);
+}
+
+static void place_service_thread(void)
+{
+	if(service_pinned)
+		sched_setaffinity(0, sizeof(service_cpus), &service_cpus);
+}
+#else
+static void placement_init(void)
+{
+	if(opt_placement != PLACE_NONE)
+		applog(LOG_WARNING, "--cpu-affinity needs Linux sysfs, not pinning");
+}
+
+static void place_miner_thread(int thr_id)
+{
+}
+
+static void place_service_thread(void)
+{
+}
+#endif
+
 /* TODO: repetitive error+log spam handling */
 bool load_scratchpad_from_file(const char *fname)
 {
 	FILE *fp;
 	long flen;
 	size_t szhi = sizeof(struct scratchpad_file_header);
+	int err = 0;
 
 	fp = fopen(fname, "rb");
 	if (fp == NULL)
@@ -1356,16 +3176,23 @@ bool load_scratchpad_from_file(const char *fname)
 		return false;
 	}
 
-	if (fread(pscratchpad_buff, 8,  fh.scratchpad_size, fp) != fh.scratchpad_size)
+	/* this runs before scratchpad_set_ready(), so holding the lock over the
+	 * read only keeps the saver and the proxy off a half-loaded buffer */
+	pthread_mutex_lock(&scratchpad_lock);
+	if (!scratchpad_read_body(fp, fh.scratchpad_size * 8, &err))
 	{
-		applog(LOG_ERR, "read error from %s: %s", fname, strerror(errno));
+		pthread_mutex_unlock(&scratchpad_lock);
+		applog(LOG_ERR, "read error from %s: %s", fname, strerror(err));
 		fclose(fp);
 		return false;
 	}
 	scratchpad_size = fh.scratchpad_size;
 	current_scratchpad_hi = fh.current_hi;
 	memcpy(&add_arr[0], &fh.add_arr[0], sizeof(fh.add_arr));
-	flen = (long)scratchpad_size*8;
+	/* no generation bump: the buffer now matches the file, nothing to save */
+	pthread_mutex_unlock(&scratchpad_lock);
+	work_avail_notify();
+	flen = (long)fh.scratchpad_size*8;
 
 	applog(LOG_DEBUG, "loaded scratchpad %s (%ld bytes), height=%" PRIu64, fname, flen, current_scratchpad_hi.height);
 	fclose(fp);
@@ -1426,197 +3253,605 @@ static bool try_mkdir_chdir(const char *dirn)
 			return false;
 		}
 	}
-	return true;
+	return true;
+}
+
+
+/* periodic jobs of the stratum loop, kept as absolute deadlines (0 when
+ * disarmed); the loop sleeps in the event loop until the earliest one */
+enum stratum_timer_id {
+	TIMER_KEEPALIVE,	/* connection idle: send keepalived */
+	TIMER_RECV,		/* pool silent for too long: reconnect */
+	TIMER_SAVE,		/* persist the scratchpad */
+	TIMER_STATS,		/* periodic summary line */
+	TIMER_COUNT
+};
+
+#define KEEPALIVE_INTERVAL	90
+#define RECV_TIMEOUT		300
+#define SAVE_INTERVAL		(12 * 3600)
+#define SAVE_RETRY		60
+#define STATS_INTERVAL		300
+
+static time_t stratum_timers[TIMER_COUNT];
+
+static inline void stratum_timer_arm(enum stratum_timer_id t, time_t now, int secs)
+{
+	stratum_timers[t] = now + secs;
+}
+
+static inline bool stratum_timer_due(enum stratum_timer_id t, time_t now)
+{
+	return stratum_timers[t] && now >= stratum_timers[t];
+}
+
+/* milliseconds until the earliest armed deadline */
+static int stratum_timer_next(time_t now)
+{
+	time_t next = now + RECV_TIMEOUT, req = stratum_requests_deadline(stratum);
+	int i;
+
+	for (i = 0; i < TIMER_COUNT; i++) {
+		if (stratum_timers[i] && stratum_timers[i] < next)
+			next = stratum_timers[i];
+	}
+	if (req && req < next)
+		next = req;
+	return next > now ? (next - now) * 1000 : 0;
+}
+
+static void stratum_log_stats(void)
+{
+	int i;
+
+	applog(LOG_INFO, "stats: %.2f/%.2f/%.2f khash/s (1m/15m/1h), accepted: %lu/%lu, stale: %lu",
+		1e-3 * stats_hashrate(0), 1e-3 * stats_hashrate(1), 1e-3 * stats_hashrate(2),
+		accepted_count, accepted_count + rejected_count, stale_count);
+	if(lat_wake.count)
+	{
+		char wake[64];
+
+		hist_summary(&lat_wake, wake, sizeof(wake));
+		applog(LOG_INFO, "miner wakeup p50/p90/p99/max: %s", wake);
+	}
+	if(lat_trace_decode.count)
+	{
+		char decode[64], patch[64], publish[64], notice[64], total[64];
+
+		hist_summary(&lat_trace_decode, decode, sizeof(decode));
+		hist_summary(&lat_trace_patch, patch, sizeof(patch));
+		hist_summary(&lat_trace_publish, publish, sizeof(publish));
+		applog(LOG_INFO, "job propagation p50/p90/p99/max: decode %s, scratchpad %s, publish %s",
+			decode, patch, publish);
+		for(i = 0; i < opt_n_threads; i++)
+		{
+			hist_summary(&thr_traces[i].notice, notice, sizeof(notice));
+			hist_summary(&thr_traces[i].total, total, sizeof(total));
+			applog(LOG_INFO, "GPU #%d job pickup p50/p90/p99/max: %s after publish, %s after receive",
+				i, notice, total);
+		}
+	}
+
+	for(i = 0; i < num_pools; i++)
+	{
+		struct stratum_ctx *sctx = &pools[i].ctx;
+		char submit[64], getjob[64], login[64], job[64];
+
+		if(!sctx->lat_login.count)
+			continue;
+		hist_summary(&sctx->lat_submit, submit, sizeof(submit));
+		hist_summary(&sctx->lat_getjob, getjob, sizeof(getjob));
+		hist_summary(&sctx->lat_login, login, sizeof(login));
+		hist_summary(&sctx->lat_job_start, job, sizeof(job));
+		applog(LOG_INFO, "pool #%d latency p50/p90/p99/max: submit %s, getjob %s, login %s, job->hash %s",
+			i, submit, getjob, login, job);
+		if(opt_debug)
+			applog(LOG_DEBUG, "pool #%d lines decoded: %lu fast, %lu by jansson",
+				i, sctx->fast_lines, sctx->json_lines);
+		if(sctx->batches)
+		{
+			hist_summary(&sctx->lat_batch_wait, submit, sizeof(submit));
+			applog(LOG_INFO, "pool #%d submit batches: %lu for %lu shares (%.2f avg, %d max), window wait %s",
+				i, sctx->batches, sctx->batched_shares, (double)sctx->batched_shares / sctx->batches,
+				sctx->batch_max, submit);
+		}
+	}
+}
+
+/* document served by the stats endpoint (--api-bind) */
+char *stats_json(void)
+{
+	static const char *state_names[] = { "down", "standby", "active", "dead" };
+	json_t *val, *arr, *pool, *lat;
+	char *s;
+	int i, w;
+
+	val = json_object();
+	json_object_set_new(val, "hashrate", json_real(stats_hashrate(0)));
+	json_object_set_new(val, "hashrate_15m", json_real(stats_hashrate(1)));
+	json_object_set_new(val, "hashrate_1h", json_real(stats_hashrate(2)));
+	json_object_set_new(val, "hashrate_last", json_real(stats_hashrate(-1)));
+	json_object_set_new(val, "accepted", json_integer(accepted_count));
+	json_object_set_new(val, "rejected", json_integer(rejected_count));
+	json_object_set_new(val, "stale", json_integer(stale_count));
+	json_object_set_new(val, "queued_shares", json_integer(share_backlog_len));
+	json_object_set_new(val, "nonce_steals", json_integer(nonce_steals));
+	json_object_set_new(val, "scan_candidates", json_integer(scan_candidates));
+	json_object_set_new(val, "scan_candidates_dropped", json_integer(scan_dropped));
+	pool = json_object();
+	json_object_set_new(pool, "enabled", throttle_enabled() ? json_true() : json_false());
+	json_object_set_new(pool, "target_pressure_pct", json_integer(opt_throttle_psi));
+	json_object_set_new(pool, "target_load_per_cpu", json_real(opt_throttle_load));
+	json_object_set_new(pool, "active_threads", json_integer(throttle_active));
+	json_object_set_new(pool, "duty", json_real(throttle_duty / 1000.));
+	json_object_set_new(pool, "pressure_memory_pct", json_real(throttle.psi_mem));
+	json_object_set_new(pool, "pressure_cpu_pct", json_real(throttle.psi_cpu));
+	json_object_set_new(pool, "load1", json_real(throttle.load1));
+	json_object_set_new(pool, "cgroup_cpus", json_real(throttle.cgroup_cpus));
+	json_object_set_new(pool, "backoffs", json_integer(throttle.backoffs));
+	json_object_set_new(pool, "restores", json_integer(throttle.restores));
+	json_object_set_new(val, "throttle", pool);
+	arr = json_array();
+	for(i = 0; i < opt_n_threads; i++)
+	{
+		struct thr_stats *st = &thr_stats[i];
+
+		pool = json_object();
+		json_object_set_new(pool, "hashes", json_integer(st->hashes));
+		json_object_set_new(pool, "scan_s", json_real(st->scan_us * 1e-6));
+		json_object_set_new(pool, "last", json_real(st->last));
+		json_object_set_new(pool, "cpu", json_integer(thr_cpus ? thr_cpus[i] : -1));
+		lat = json_array();
+		for(w = 0; w < RATE_WINDOWS; w++)
+			json_array_append_new(lat, json_real(st->ewma[w]));
+		json_object_set_new(pool, "ewma_1m_15m_1h", lat);
+		json_array_append_new(arr, pool);
+	}
+	json_object_set_new(val, "threads", arr);
+	arr = json_array();
+	for(i = 0; i < opt_n_threads; i++)
+	{
+		pool = json_object();
+		json_object_set_new(pool, "target_ms", json_integer(opt_batch_ms));
+		json_object_set_new(pool, "scale", json_real(batch_ctls[i].scale));
+		json_object_set_new(pool, "rate", json_real(batch_ctls[i].rate));
+		json_object_set_new(pool, "nonces", json_integer(batch_ctls[i].nonces));
+		json_object_set_new(pool, "ms", json_real(batch_ctls[i].ms));
+		json_object_set_new(pool, "pickup_ms", json_real(batch_ctls[i].pickup_us * 1e-3));
+		json_array_append_new(arr, pool);
+	}
+	json_object_set_new(val, "batch", arr);
+	json_object_set_new(val, "height", json_integer(current_scratchpad_hi.height));
+	json_object_set_new(val, "wakeup", hist_json(&lat_wake));
+	lat = json_object();
+	json_object_set_new(lat, "decode", hist_json(&lat_trace_decode));
+	json_object_set_new(lat, "scratchpad", hist_json(&lat_trace_patch));
+	json_object_set_new(lat, "publish", hist_json(&lat_trace_publish));
+	arr = json_array();
+	for(i = 0; i < opt_n_threads; i++)
+	{
+		pool = json_object();
+		json_object_set_new(pool, "notice", hist_json(&thr_traces[i].notice));
+		json_object_set_new(pool, "total", hist_json(&thr_traces[i].total));
+		json_array_append_new(arr, pool);
+	}
+	json_object_set_new(lat, "threads", arr);
+	json_object_set_new(val, "job_propagation", lat);
+
+	arr = json_array();
+	for(i = 0; i < num_pools; i++)
+	{
+		struct stratum_ctx *sctx = &pools[i].ctx;
+
+		pool = json_object();
+		json_object_set_new(pool, "id", json_integer(i));
+		json_object_set_new(pool, "url", json_string(pools[i].url ? pools[i].url : ""));
+		json_object_set_new(pool, "state", json_string(state_names[pools[i].state]));
+		lat = json_object();
+		json_object_set_new(lat, "submit", hist_json(&sctx->lat_submit));
+		json_object_set_new(lat, "getjob", hist_json(&sctx->lat_getjob));
+		json_object_set_new(lat, "login", hist_json(&sctx->lat_login));
+		json_object_set_new(lat, "job_to_hash", hist_json(&sctx->lat_job_start));
+		json_object_set_new(pool, "latency", lat);
+		lat = json_object();
+		json_object_set_new(lat, "batches", json_integer(sctx->batches));
+		json_object_set_new(lat, "shares", json_integer(sctx->batched_shares));
+		json_object_set_new(lat, "max", json_integer(sctx->batch_max));
+		json_object_set_new(lat, "window_ms", json_integer(opt_submit_window));
+		json_object_set_new(lat, "wait", hist_json(&sctx->lat_batch_wait));
+		json_object_set_new(pool, "submit_batches", lat);
+		json_object_set_new(pool, "lines_fast", json_integer(sctx->fast_lines));
+		json_object_set_new(pool, "lines_json", json_integer(sctx->json_lines));
+		json_array_append_new(arr, pool);
+	}
+	json_object_set_new(val, "pools", arr);
+
+	s = json_dumps(val, JSON_INDENT(1));
+	json_decref(val);
+	return s;
+}
+
+static void stratum_run_timers(time_t now)
+{
+	if (stratum_timer_due(TIMER_KEEPALIVE, now)) {
+		applog(LOG_INFO, "Keepalive send....");
+		stratum_keepalived(stratum, rpc2_id);
+		stratum_timer_arm(TIMER_KEEPALIVE, now, KEEPALIVE_INTERVAL);
+	}
+	if (stratum_timer_due(TIMER_SAVE, now))
+		stratum_timer_arm(TIMER_SAVE, now,
+			store_scratchpad_to_file(opt_scratchpad_fsync) ? SAVE_INTERVAL : SAVE_RETRY);
+	stratum_expire_requests(stratum, now);
+	if (stratum_timer_due(TIMER_STATS, now)) {
+		stratum_log_stats();
+		stratum_timer_arm(TIMER_STATS, now, STATS_INTERVAL);
+	}
+}
+
+static const char *pool_user(struct pool_info *pool)
+{
+	return pool->user ? pool->user : rpc_user;
+}
+
+static const char *pool_pass(struct pool_info *pool)
+{
+	return pool->pass ? pool->pass : rpc_pass;
+}
+
+static void pool_set_state(struct pool_info *pool, enum pool_state state)
+{
+	int i;
+
+	pthread_mutex_lock(&pools_lock);
+	pool->state = state;
+	pthread_cond_broadcast(&pools_cond);
+	/* a better pool may be back: let the active loop take a look */
+	for (i = 0; state == POOL_STANDBY && i < num_pools; i++) {
+		if (pools[i].state == POOL_ACTIVE)
+			stratum_interrupt(&pools[i].ctx);
+	}
+	pthread_mutex_unlock(&pools_lock);
 }
 
+/*
+ * Keeps one pool connected and logged in while it is not the active job
+ * source, so failing over to it only costs a getjob. Jobs pushed to a
+ * standby session are ignored; the getjob sent on activation carries the
+ * current scratchpad height and brings the missing addendums.
+ */
+static void *pool_thread(void *userdata)
+{
+	struct pool_info *pool = userdata;
+	struct stratum_ctx *sctx = &pool->ctx;
+	time_t now, keepalive = 0, last_rx = 0;
+	int failures = 0, rc;
+	bool was_active;
+	char *s;
 
-static bool stratum_handle_response(char *buf) {
-	json_t *val, *err_val, *res_val, *id_val;
-	json_error_t err;
-	bool ret = false;
-	bool valid = false;
-
-	val = JSON_LOADS(buf, &err);
-	if (!val) {
-		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
-		goto out;
-	}
+	while (1) {
+		pthread_mutex_lock(&pools_lock);
+		if (pool->want_active && pool->state == POOL_STANDBY) {
+			pool->want_active = false;
+			sctx->standby = false;
+			pool->state = POOL_ACTIVE;
+			pthread_cond_broadcast(&pools_cond);
+		}
+		was_active = false;
+		while (pool->state == POOL_ACTIVE) {
+			was_active = true;
+			pthread_cond_wait(&pools_cond, &pools_lock);
+		}
+		pthread_mutex_unlock(&pools_lock);
 
-	res_val = json_object_get(val, "result");
-	err_val = json_object_get(val, "error");
-	id_val = json_object_get(val, "id");
+		/* the stratum thread read this session meanwhile: time it afresh */
+		if (was_active) {
+			last_rx = time(NULL);
+			keepalive = last_rx + KEEPALIVE_INTERVAL;
+		}
 
-	if (!id_val || json_is_null(id_val) /*|| !res_val*/)
-		goto out;
+		if (!sctx->curl) {
+			/* don't hammer a pool that keeps dropping us right after login */
+			if (pool->last_login && time(NULL) - pool->last_login < opt_fail_pause)
+				sleep(opt_fail_pause);
 
-	if(jsonrpc_2)
-	{
-		json_t *status = NULL;
-		if(res_val)
-			status = json_object_get(res_val, "status");
-		if(status) {
-			const char *s = json_string_value(status);
-			if (!strcmp(s, "KEEPALIVED")) {
-				applog(LOG_INFO, "Keepalive receveid");
-				goto out;
+			sctx->standby = true;
+			/* the login carries the scratchpad height, so only the
+			 * connect overlaps with the scratchpad warm-up */
+			if (!stratum_connect(sctx, pool->url)
+				|| !stratum_subscribe(sctx)
+				|| !scratchpad_wait_ready()
+				|| !stratum_authorize(sctx, pool_user(pool), pool_pass(pool))) {
+					stratum_disconnect(sctx);
+					if (opt_retries >= 0 && ++failures > opt_retries) {
+						applog(LOG_ERR, "pool #%d %s: giving up", pool->id, pool->url);
+						pool_set_state(pool, POOL_DEAD);
+						return NULL;
+					}
+					applog(LOG_ERR, "pool #%d: ...retry after %d seconds", pool->id, opt_fail_pause);
+					sleep(opt_fail_pause);
+					continue;
 			}
-			valid = !strcmp(s, "OK") && json_is_null(err_val);
-		} else {
-			valid = json_is_null(err_val);
+			failures = 0;
+			keepalive = last_rx = pool->last_login = time(NULL);
+			keepalive += KEEPALIVE_INTERVAL;
+			if (num_pools > 1)
+				applog(LOG_INFO, "pool #%d %s: logged in, standing by", pool->id, pool->url);
+			pool_set_state(pool, POOL_STANDBY);
+			continue;
 		}
 
-		if(err_val && !json_is_null(err_val) )
-		{
-			const char* perr_msg = get_json_string_param(err_val, "message");
-			if(perr_msg && !strcmp(perr_msg, "Unauthenticated"))
-			{
-				applog(LOG_ERR, "Response returned \"Unauthenticated\", need to relogin");
-				err_val = json_object_get(err_val, "message");
-				valid = false;
-			}
-			else if(perr_msg && !strcmp(perr_msg, "Low difficulty share"))
-			{
-				//applog(LOG_ERR, "Dump scratchpad file");
-				//dump_scrstchpad_to_file();
-			}
+		now = time(NULL);
+		if (now >= keepalive) {
+			stratum_keepalived(sctx, sctx->session_id);
+			keepalive = now + KEEPALIVE_INTERVAL;
+		}
+		rc = stratum_wait(sctx, (keepalive - now) * 1000);
+		now = time(NULL);
+		stratum_expire_requests(sctx, now);
+		if (!rc && now - last_rx < RECV_TIMEOUT)
+			continue;
+		s = rc > 0 ? stratum_recv_line(sctx) : NULL;
+		if (!s) {
+			applog(LOG_ERR, "pool #%d %s: standby connection lost", pool->id, pool->url);
+			stratum_disconnect(sctx);
+			pool_set_state(pool, POOL_DOWN);
+			continue;
+		}
+		last_rx = now;
+		stratum_handle_line(sctx, s);
+	}
+}
 
-			strcpy(rpc2_id, "");
-			stratum_have_work = false;
-			restart_threads();
+/*
+ * Takes the highest-priority logged-in pool over from its pool thread,
+ * waiting for one if none is up. NULL once every pool has given up.
+ */
+static struct pool_info *pool_activate_best(void)
+{
+	struct pool_info *pool = NULL;
+	int i, dead;
+
+	pthread_mutex_lock(&pools_lock);
+	while (!pool) {
+		for (i = dead = 0; i < num_pools; i++) {
+			if (pools[i].state == POOL_STANDBY)
+				break;
+			dead += pools[i].state == POOL_DEAD;
 		}
-	} else {
-		valid = res_val && json_is_true(res_val);
+		if (i < num_pools) {
+			pool = &pools[i];
+			pool->want_active = true;
+			stratum_interrupt(&pool->ctx);
+			while (pool->want_active && pool->state == POOL_STANDBY)
+				pthread_cond_wait(&pools_cond, &pools_lock);
+			if (pool->state != POOL_ACTIVE) {
+				/* dropped while we were asking */
+				pool->want_active = false;
+				pool = NULL;
+			}
+		} else if (dead == num_pools)
+			break;
+		else
+			pthread_cond_wait(&pools_cond, &pools_lock);
 	}
+	pthread_mutex_unlock(&pools_lock);
+	return pool;
+}
 
-	share_result(valid, NULL,
-		err_val ? (jsonrpc_2 ? json_string_value(err_val) : json_string_value(json_array_get(err_val, 1))) : NULL );
+static bool pool_better_ready(struct pool_info *active)
+{
+	bool ret = false;
+	int i;
 
-	ret = true;
-out: if (val)
-		 json_decref(val);
+	pthread_mutex_lock(&pools_lock);
+	for (i = 0; i < active->id; i++)
+		ret |= pools[i].state == POOL_STANDBY;
+	pthread_mutex_unlock(&pools_lock);
+	return ret;
+}
 
-	 return ret;
+/* hands the active pool back to its pool thread */
+static void pool_release(struct pool_info *pool, bool failed)
+{
+	if (failed)
+		stratum_disconnect(&pool->ctx);
+	pool->ctx.standby = true;
+	pool_set_state(pool, failed ? POOL_DOWN : POOL_STANDBY);
 }
 
 static void *stratum_thread(void *userdata) {
 	struct thr_info *mythr = userdata;
+	struct pool_info *active = NULL;
+	bool need_job = false, need_replay = false;
+	pthread_t pth;
 	char *s;
+	time_t now;
+	int rc, i;
 
-	stratum.url = tq_pop(mythr->q, NULL );
-	if (!stratum.url)
+	place_service_thread();
+	s = tq_pop(mythr->q, NULL );
+	if (!s)
 		goto out;
-	applog(LOG_INFO, "Starting Stratum on %s", stratum.url);
+	free(s);
+	applog(LOG_INFO, "Starting Stratum on %s", pools[0].url);
+	for (i = 0; i < num_pools; i++) {
+		if (i)
+			applog(LOG_INFO, "Failover pool #%d: %s", i, pools[i].url);
+		if (unlikely(pthread_create(&pth, NULL, pool_thread, &pools[i]))) {
+			applog(LOG_ERR, "pool thread create failed");
+			goto out;
+		}
+		pthread_detach(pth);
+	}
+
+	now = time(NULL);
+	if (opt_algo == ALGO_WILD_KECCAK)
+		stratum_timer_arm(TIMER_SAVE, prev_save ? prev_save : now, SAVE_INTERVAL);
+	stratum_timer_arm(TIMER_STATS, now, STATS_INTERVAL);
 
 	while (1) {
-		int failures = 0;
+		if (active && active->id && pool_better_ready(active)) {
+			applog(LOG_INFO, "higher priority pool is back, failing back");
+			pool_release(active, false);
+			active = NULL;
+		}
 
-		while (!stratum.curl) {
+		if (!active) {
+			/* the miners keep scanning the last job meanwhile, see
+			 * --outage-grace; the next pool's job replaces it */
 			pthread_mutex_lock(&g_work_lock);
+			if (g_work_time && !pool_offline_since)
+				pool_offline_since = time(NULL);
 			g_work_time = 0;
 			pthread_mutex_unlock(&g_work_lock);
-			restart_threads();
 
-			if (!stratum_connect(&stratum, stratum.url)
-				|| !stratum_subscribe(&stratum)
-				|| !stratum_authorize(&stratum, rpc_user, rpc_pass)) {
-					stratum_disconnect(&stratum);
-					if (opt_retries >= 0 && ++failures > opt_retries) {
-						applog(LOG_ERR, "...terminating workio thread");
-						tq_push(thr_info[work_thr_id].q, NULL );
-						goto out;
-					}
-					applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
-					sleep(opt_fail_pause);
+			active = pool_activate_best();
+			if (!active) {
+				applog(LOG_ERR, "...terminating workio thread");
+				tq_push(thr_info[work_thr_id].q, NULL );
+				goto out;
 			}
+			pthread_mutex_lock(&session_lock);
+			stratum = &active->ctx;
+			strncpy(rpc2_id, stratum->session_id ? stratum->session_id : "", sizeof(rpc2_id) - 1);
+			pthread_mutex_unlock(&session_lock);
+			stratum_timers[TIMER_RECV] = stratum_timers[TIMER_KEEPALIVE] = 0;
+			if (num_pools > 1)
+				applog(LOG_INFO, "Switching to pool #%d %s", active->id, active->url);
+			need_job = true;
+			need_replay = true;
 		}
 
 		if(!strcmp(rpc2_id, ""))
 		{
-			if (opt_debug)
-				applog(LOG_DEBUG, "disconnecting...");
-			stratum_disconnect(&stratum);
-			//not logged in, try to relogin
+			/* not logged in: the pool thread reconnects and logs in again */
 			if (opt_debug)
 				applog(LOG_DEBUG, "Re-connect and relogin...");
-			if(!stratum_connect(&stratum, stratum.url) || !stratum_authorize(&stratum, rpc_user, rpc_pass))
-			{
-				stratum_disconnect(&stratum);
-				applog(LOG_ERR, "Failed...retry after %d seconds", opt_fail_pause);
-				sleep(opt_fail_pause);
-			}
+			pool_release(active, true);
+			active = NULL;
+			continue;
 		}
 
 		if(opt_algo == ALGO_WILD_KECCAK && !scratchpad_size)
 		{
-			if(!stratum_getscratchpad(&stratum))
+			if(!stratum_getscratchpad(stratum))
 			{
-				stratum_disconnect(&stratum);
-				applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
-				sleep(opt_fail_pause);
+				pool_release(active, true);
+				active = NULL;
+				continue;
 			}
-			store_scratchpad_to_file(false);
-			prev_save = time(NULL);
+			stratum_timer_arm(TIMER_SAVE, time(NULL), store_scratchpad_to_file(opt_scratchpad_fsync) ? SAVE_INTERVAL : SAVE_RETRY);
+			need_job = true;
+		}
 
-			if(!stratum_request_job(&stratum))
+		if (need_job)
+		{
+			if(!stratum_request_job(stratum))
 			{
-				stratum_disconnect(&stratum);
-				applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
-				sleep(opt_fail_pause);
+				pool_release(active, true);
+				active = NULL;
+				continue;
 			}
-		}
-		if(opt_algo == ALGO_WILD_KECCAK)
-		{
-		  /* save every 12 hours */
-		  if ((time(NULL) - prev_save) > 12*3600)
-		  {
-			store_scratchpad_to_file(false);
-			prev_save = time(NULL);
-		  }
+			need_job = false;
 		}
 
 		if (jsonrpc_2) {
-			if (stratum.work.job_id && (!g_work_time || strcmp(stratum.work.job_id, g_work.job_id)))
+			if (stratum->work.job_id && (!g_work_time || strcmp(stratum->work.job_id, g_work.job_id)))
 			{
+				struct job_trace trace;
+
 				pthread_mutex_lock(&g_work_lock);
-				stratum_gen_work(&stratum, &g_work);
+				stratum_gen_work(stratum, &g_work);
 				time(&g_work_time);
+				pool_offline_since = 0;
 				pthread_mutex_unlock(&g_work_lock);
+
+				if (!strcmp(job_trace.job_id, g_work.job_id))
+				{
+					trace = job_trace;
+					hist_record_since(&lat_trace_publish, &trace.patched);
+				}
+				else
+					memset(&trace, 0, sizeof(trace));
+				gettimeofday(&trace.published, NULL);
+				job_publish(&g_work, &trace, stratum, 0);
+				work_avail_notify();
 				applog(LOG_INFO, "Stratum detected new block");
 				restart_threads();
+				proxy_notify_job();
+			}
+			else if (job_lane_wanted && job_lane_wanted == job_gen)
+			{
+				/* same job on the next lane, the miners finish their ranges first */
+				struct job_trace trace;
+				unsigned int lane = cur_job->lane + 1;
+
+				memset(&trace, 0, sizeof(trace));
+				gettimeofday(&trace.published, NULL);
+				job_publish(&g_work, &trace, stratum, lane);
+				work_avail_notify();
+				if (opt_debug)
+					applog(LOG_DEBUG, "job %s: nonce lane %u", g_work.job_id, lane);
+			}
+			if (need_replay && g_work_time)
+			{
+				need_replay = false;
+				share_backlog_replay();
 			}
 		} else {
-			if (stratum.job.job_id
+			if (stratum->job.job_id
 				&& (!g_work_time
-				|| strcmp(stratum.job.job_id, g_work.job_id))) {
+				|| strcmp(stratum->job.job_id, g_work.job_id))) {
 					pthread_mutex_lock(&g_work_lock);
-					stratum_gen_work(&stratum, &g_work);
+					stratum_gen_work(stratum, &g_work);
 					time(&g_work_time);
 					pthread_mutex_unlock(&g_work_lock);
-					if (stratum.job.clean) {
+					if (stratum->job.clean) {
 						applog(LOG_INFO, "Stratum detected new block");
 						restart_threads();
 					}
 			}
 		}
 
-		if (opt_keepalive && !stratum_socket_full(&stratum, 90)) {
-			applog(LOG_INFO, "Keepalive send....");
-			stratum_keepalived(&stratum, rpc2_id);
-			s = NULL;
+		now = time(NULL);
+		if (!stratum_timers[TIMER_RECV]) {
+			/* fresh connection */
+			stratum_timer_arm(TIMER_RECV, now, RECV_TIMEOUT);
+			if (opt_keepalive)
+				stratum_timer_arm(TIMER_KEEPALIVE, now, KEEPALIVE_INTERVAL);
 		}
-		if (!stratum_socket_full(&stratum, 300)) {
+
+		s = NULL;
+		rc = stratum_wait(stratum, stratum_timer_next(now));
+		now = time(NULL);
+		if (rc > 0)
+			s = stratum_recv_line(stratum);
+		else if (!rc && !stratum_timer_due(TIMER_RECV, now)) {
+			stratum_run_timers(now);
+			continue;
+		} else if (!rc)
 			applog(LOG_ERR, "Stratum connection timed out");
-			s = NULL;
-		} else
-			s = stratum_recv_line(&stratum);
 		if (!s) {
-			stratum_disconnect(&stratum);
 			applog(LOG_ERR, "Stratum connection interrupted");
+			pool_release(active, true);
+			active = NULL;
+			continue;
+		}
+
+		now = time(NULL);
+		stratum_timer_arm(TIMER_RECV, now, RECV_TIMEOUT);
+		if (opt_keepalive)
+			stratum_timer_arm(TIMER_KEEPALIVE, now, KEEPALIVE_INTERVAL);
+
+		stratum_handle_line(stratum, s);
+		stratum_run_timers(now);
+
+		if (stratum->interrupted) {
+			/* a failback kick that came in while the line was
+			 * being received: the top of the loop acts on it */
+			stratum->interrupted = false;
 			continue;
 		}
-		if (!stratum_handle_method(&stratum, s))
-			stratum_handle_response(s);
-		free(s);
 	}
 
 out: return NULL ;
@@ -1676,6 +3911,27 @@ static void show_usage_and_exit(int status) {
 	exit(status);
 }
 
+/* adds a stratum+tcp://[user[:pass]@]host:port failover pool */
+static void pool_add(const char *arg)
+{
+	struct pool_info *pool = &pools[num_pools++];
+	char *p, *ap, *sp;
+
+	pool->url = strdup(arg);
+	p = strrchr(pool->url, '@');
+	if (p) {
+		*p = '\0';
+		ap = pool->url + strlen(STRATUM_PREFIX);
+		sp = strchr(ap, ':');
+		if (sp) {
+			pool->pass = strdup(sp + 1);
+			*sp = '\0';
+		}
+		pool->user = strdup(ap);
+		memmove(ap, p + 1, strlen(p + 1) + 1);
+	}
+}
+
 static void parse_arg(int key, char *arg) {
 	char *p;
 	int v, i;
@@ -1771,6 +4027,13 @@ static void parse_arg(int key, char *arg) {
 		rpc_user = strdup(arg);
 		break;
 	case 'o': /* --url */
+		if (rpc_url) {
+			/* repeated -o: failover pool, in priority order */
+			if (num_pools >= MAX_POOLS || strncasecmp(arg, STRATUM_PREFIX, strlen(STRATUM_PREFIX)))
+				show_usage_and_exit(1);
+			pool_add(arg);
+			break;
+		}
 		p = strstr(arg, "://");
 		if (p) {
 			if (strncasecmp(arg, "http://", 7)
@@ -1849,6 +4112,102 @@ static void parse_arg(int key, char *arg) {
 	case 1003:
 		want_longpoll = false;
 		break;
+	case 1011:
+		opt_scratchpad_fsync = true;
+		break;
+	case 1012:
+		free(opt_api_bind);
+		opt_api_bind = strdup(arg);
+		break;
+	case 1013:
+		free(opt_proxy_listen);
+		opt_proxy_listen = strdup(arg);
+		break;
+	case 1014:
+		v = atoi(arg);
+		if (v < 0 || v > 1000)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_submit_window = v;
+		break;
+	case 1015:
+		v = atoi(arg);
+		if (v < 0 || v > 3600)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_outage_grace = v;
+		break;
+	case 1016:
+		v = atoi(arg);
+		if (v < 10 || v > 5000)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_batch_ms = v;
+		break;
+	case 1017:
+		tq_bench();
+		exit(0);
+	case 1018:
+		v = atoi(arg);
+		if (v < 0 || v > 255)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_nonce_prefix = v;
+		break;
+	case 1019:
+		if (!scan_device_select(arg))
+			show_usage_and_exit(1);
+		break;
+	case 1020:
+		for (i = 0; i < ARRAY_SIZE(placement_names); i++) {
+			if (i != PLACE_MASK && !strcasecmp(arg, placement_names[i]))
+				break;
+		}
+		if (i < ARRAY_SIZE(placement_names)) {
+			opt_placement = i;
+			break;
+		}
+#ifdef __linux
+		if (!strncasecmp(arg, "0x", 2)) {
+			/* hex mask, lowest CPUs in the last digit */
+			size_t len = strlen(arg + 2);
+
+			CPU_ZERO(&opt_placement_mask);
+			for (i = 0; i < len; i++) {
+				unsigned char c = arg[2 + len - 1 - i];
+				int d = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+
+				if (!isxdigit(c))
+					show_usage_and_exit(1);
+				for (v = 0; v < 4; v++)
+					if ((d >> v & 1) && 4 * i + v < CPU_SETSIZE)
+						CPU_SET(4 * i + v, &opt_placement_mask);
+			}
+		} else if (!parse_cpulist(arg, &opt_placement_mask))
+			show_usage_and_exit(1);
+		if (!CPU_COUNT(&opt_placement_mask))
+			show_usage_and_exit(1);
+		opt_placement = PLACE_MASK;
+		break;
+#else
+		show_usage_and_exit(1);
+#endif
+	case 1021:
+		v = atoi(arg);
+		if (v < 1 || v > 100)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_throttle_psi = v;
+		break;
+	case 1022:
+		opt_throttle_load = atof(arg);
+		if (opt_throttle_load <= 0 || opt_throttle_load > 1000)	/* sanity check */
+			show_usage_and_exit(1);
+		break;
+	case 1010:
+		for (i = 0; i < ARRAY_SIZE(hugepage_names); i++) {
+			if (!strcasecmp(arg, hugepage_names[i]))
+				break;
+		}
+		if (i == ARRAY_SIZE(hugepage_names))
+			show_usage_and_exit(1);
+		opt_hugepages = i;
+		break;
 	case 1007:
 		want_stratum = false;
 		break;
@@ -1987,55 +4346,151 @@ bool download_inital_scratchpad(const char* path_to, const char* url)
 }
 
 #if !defined(_WIN64) && !defined(_WIN32)
-void GetScratchpad(void)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGEPAGE_2M_SIZE (1UL << 21)
+#define HUGEPAGE_1G_SIZE (1UL << 30)
+
+static void *scratchpad_map(size_t len, int flags)
 {
-	size_t sz = WILD_KECCAK_SCRATCHPAD_BUFFSIZE;
-	const char *phome_var_name = "HOME";
-	char cachedir[PATH_MAX];
+	void *p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
 
-	if(!getenv(phome_var_name))
+#ifdef MAP_HUGETLB
+static void *scratchpad_map_hugetlb(size_t sz, size_t page, int huge_flag)
+{
+	size_t len = (sz + page - 1) & ~(page - 1);
+	void *p = scratchpad_map(len, MAP_HUGETLB | huge_flag);
+
+	if(p)
 	{
-		applog(LOG_ERR, "$%s not set", phome_var_name);
-		exit(1);
+		scratchpad_map_len = len;
+		scratchpad_page_size = page;
 	}
-	else if(!try_mkdir_chdir(getenv(phome_var_name)))
+	return p;
+}
+#endif
+
+/* over-map by one huge page so the buffer starts on a 2M boundary, which
+ * is what khugepaged needs to back it with PMD-sized pages */
+static void *scratchpad_map_aligned(size_t sz, int advice)
+{
+	size_t len = sz + HUGEPAGE_2M_SIZE;
+	uint8_t *p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uint8_t *aligned;
+
+	if(p == MAP_FAILED) return NULL;
+
+	aligned = (uint8_t *)(((uintptr_t)p + HUGEPAGE_2M_SIZE - 1) & ~(HUGEPAGE_2M_SIZE - 1));
+	if(aligned != p) munmap(p, aligned - p);
+	munmap(aligned + sz, (p + len) - (aligned + sz));
+
+	if(madvise(aligned, sz, advice) == -1 && advice == MADV_HUGEPAGE)
 	{
-		exit(1);
+		applog(LOG_INFO, "madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+		munmap(aligned, sz);
+		return NULL;
 	}
+	scratchpad_map_len = sz;
+	if(advice == MADV_HUGEPAGE) scratchpad_page_size = HUGEPAGE_2M_SIZE;
+	return aligned;
+}
 
-	if(!try_mkdir_chdir(".cache")) exit(1);
-
-	if(!try_mkdir_chdir(cachedir_suffix)) exit(1);
+static uint64_t *scratchpad_alloc(size_t sz, enum hugepage_policy policy)
+{
+	void *p = NULL;
 
-	if (getcwd(cachedir, sizeof(cachedir) - 22) == NULL)
+#ifdef MAP_HUGETLB
+	if(policy == HUGEPAGE_1G || policy == HUGEPAGE_AUTO)
 	{
-		applog(LOG_ERR, "getcwd failed: %s", strerror(errno));
-		exit(1);
+		p = scratchpad_map_hugetlb(sz, HUGEPAGE_1G_SIZE, MAP_HUGE_1GB);
+		if(p) return p;
+		applog(LOG_INFO, "1G hugetlb pages not available");
+	}
+	if(policy == HUGEPAGE_2M || policy == HUGEPAGE_AUTO)
+	{
+		p = scratchpad_map_hugetlb(sz, HUGEPAGE_2M_SIZE, MAP_HUGE_2MB);
+		if(p) return p;
+		applog(LOG_INFO, "2M hugetlb pages not available");
 	}
+#endif
+#ifdef MADV_HUGEPAGE
+	if(policy == HUGEPAGE_THP || policy == HUGEPAGE_AUTO)
+	{
+		p = scratchpad_map_aligned(sz, MADV_HUGEPAGE);
+		if(p) return p;
+		applog(LOG_INFO, "transparent huge pages not available");
+	}
+#endif
+#ifdef MADV_NOHUGEPAGE
+	if(policy == HUGEPAGE_4K)
+		return scratchpad_map_aligned(sz, MADV_NOHUGEPAGE);
+#endif
 
-	snprintf(scratchpad_file, sizeof(scratchpad_file), "%s/scratchpad.bin", cachedir);
-	pscratchpad_local_cache = scratchpad_file;
+	p = scratchpad_map(sz, 0);
+	if(p) scratchpad_map_len = sz;
+	return p;
+}
 
-	applog(LOG_DEBUG, "wildkeccak scratchpad cache %s", pscratchpad_local_cache);
+/* look the scratchpad VMA up in /proc/self/smaps and describe what the
+ * kernel actually backed it with */
+static void scratchpad_describe_backing(void)
+{
+	char line[256];
+	FILE *fp;
+	bool found = false;
+	unsigned long page_kb = 0, rss_kb = 0, thp_kb = 0, hugetlb_kb = 0, v;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if(!fp)
+	{
+		snprintf(scratchpad_backing, sizeof(scratchpad_backing), "unknown");
+		return;
+	}
 
-	pscratchpad_buff = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, 0, 0);
-	if(pscratchpad_buff == MAP_FAILED)
+	while(fgets(line, sizeof(line), fp))
 	{
-		applog(LOG_INFO, "hugetlb not available");
-		pscratchpad_buff = malloc(sz);
-		if(!pscratchpad_buff)
+		unsigned long start, end;
+
+		if(sscanf(line, "%lx-%lx ", &start, &end) == 2)
 		{
-			applog(LOG_ERR, "Scratchpad allocation failed");
-			exit(1);
+			if(found) break;
+			found = (uintptr_t)pscratchpad_buff >= start && (uintptr_t)pscratchpad_buff < end;
+			continue;
 		}
+		if(!found) continue;
+
+		if(sscanf(line, "KernelPageSize: %lu kB", &v) == 1) page_kb = v;
+		else if(sscanf(line, "Rss: %lu kB", &v) == 1) rss_kb = v;
+		else if(sscanf(line, "AnonHugePages: %lu kB", &v) == 1) thp_kb = v;
+		else if(sscanf(line, "Private_Hugetlb: %lu kB", &v) == 1) hugetlb_kb += v;
+		else if(sscanf(line, "Shared_Hugetlb: %lu kB", &v) == 1) hugetlb_kb += v;
 	}
+	fclose(fp);
+
+	if(!found)
+		snprintf(scratchpad_backing, sizeof(scratchpad_backing), "unknown");
+	else if(page_kb > 4)
+		snprintf(scratchpad_backing, sizeof(scratchpad_backing), "%lu kB hugetlb pages, %lu MB mapped",
+			page_kb, hugetlb_kb >> 10);
 	else
-	{
-		applog(LOG_INFO, "using hugetlb");
-	}
-	madvise(pscratchpad_buff, sz, MADV_RANDOM | MADV_WILLNEED | MADV_HUGEPAGE);
-	mlock(pscratchpad_buff, sz);
+		snprintf(scratchpad_backing, sizeof(scratchpad_backing), "%lu kB pages, %lu of %lu MB resident in THP",
+			page_kb, thp_kb >> 10, rss_kb >> 10);
+
+	applog(LOG_INFO, "scratchpad backing (%s policy): %s", hugepage_names[opt_hugepages], scratchpad_backing);
+}
 
+static void *scratchpad_warmup_thread(void *userdata)
+{
 	if(!load_scratchpad_from_file(pscratchpad_local_cache))
 	{
 		if(!pscratchpad_url)
@@ -2055,6 +4510,58 @@ void GetScratchpad(void)
 			exit(1);
 		}
 	}
+	mlock(pscratchpad_buff, WILD_KECCAK_SCRATCHPAD_BUFFSIZE);
+	scratchpad_describe_backing();
+	scratchpad_set_ready();
+	return NULL;
+}
+
+/* allocates the scratchpad and starts loading it in the background; use
+ * scratchpad_wait_ready() before relying on its contents */
+void GetScratchpad(void)
+{
+	size_t sz = WILD_KECCAK_SCRATCHPAD_BUFFSIZE;
+	const char *phome_var_name = "HOME";
+	pthread_t pth;
+	char cachedir[PATH_MAX];
+
+	if(!getenv(phome_var_name))
+	{
+		applog(LOG_ERR, "$%s not set", phome_var_name);
+		exit(1);
+	}
+	else if(!try_mkdir_chdir(getenv(phome_var_name)))
+	{
+		exit(1);
+	}
+
+	if(!try_mkdir_chdir(".cache")) exit(1);
+
+	if(!try_mkdir_chdir(cachedir_suffix)) exit(1);
+
+	if (getcwd(cachedir, sizeof(cachedir) - 22) == NULL)
+	{
+		applog(LOG_ERR, "getcwd failed: %s", strerror(errno));
+		exit(1);
+	}
+
+	snprintf(scratchpad_file, sizeof(scratchpad_file), "%s/scratchpad.bin", cachedir);
+	pscratchpad_local_cache = scratchpad_file;
+
+	applog(LOG_DEBUG, "wildkeccak scratchpad cache %s", pscratchpad_local_cache);
+
+	pscratchpad_buff = scratchpad_alloc(sz, opt_hugepages);
+	if(!pscratchpad_buff)
+	{
+		applog(LOG_ERR, "Scratchpad allocation failed");
+		exit(1);
+	}
+	madvise(pscratchpad_buff, sz, MADV_RANDOM);
+
+	if(pthread_create(&pth, NULL, scratchpad_warmup_thread, NULL))
+		scratchpad_warmup_thread(NULL);
+	else
+		pthread_detach(pth);
 }
 
 #else
@@ -2116,6 +4623,7 @@ void GetScratchpad(void)
 			exit(1);
 		}
 	}
+	scratchpad_set_ready();
 }
 
 #endif
@@ -2130,19 +4638,32 @@ int main(int argc, char *argv[]) {
 	tzset();
 
 	pthread_mutex_init(&applog_lock, NULL );
-	pthread_mutex_init(&stats_lock, NULL );
 	pthread_mutex_init(&g_work_lock, NULL );
 	pthread_mutex_init(&rpc2_job_lock, NULL );
-	pthread_mutex_init(&stratum.sock_lock, NULL );
-	pthread_mutex_init(&stratum.work_lock, NULL );
+	pthread_mutex_init(&scratchpad_lock, NULL );
+	pthread_mutex_init(&pools_lock, NULL );
+	pthread_mutex_init(&session_lock, NULL );
+	pthread_cond_init(&pools_cond, NULL );
+	for (i = 0; i < MAX_POOLS; i++) {
+		pools[i].id = i;
+		pthread_mutex_init(&pools[i].ctx.sock_lock, NULL );
+		pthread_mutex_init(&pools[i].ctx.req_lock, NULL );
+		pthread_mutex_init(&pools[i].ctx.work_lock, NULL );
+	}
 
 	/* parse command line */
 	parse_cmdline(argc, argv);
 
+	pools[0].url = rpc_url;
+	if (num_pools > 1 && !have_stratum) {
+		applog(LOG_WARNING, "failover pools need a stratum primary, ignoring %d extra pool(s)", num_pools - 1);
+		num_pools = 1;
+	}
+
 	if(!CUDABlocks | !CUDAThreads)
 	{
-		CUDABlocks = 60;
-		CUDAThreads = 130;
+		CUDABlocks = scan_dev->blocks;
+		CUDAThreads = scan_dev->threads;
 	}
 
 	applog(LOG_INFO, "Using JSON-RPC 2.0");
@@ -2195,10 +4716,18 @@ int main(int argc, char *argv[]) {
 
 	work_restart = calloc(opt_n_threads, sizeof(*work_restart));
 	thr_info = calloc(opt_n_threads + 3, sizeof(*thr));
-	thr_hashrates = (float *)calloc(opt_n_threads, sizeof(float));
+	thr_stats = calloc(opt_n_threads, sizeof(*thr_stats));
+	thr_traces = calloc(opt_n_threads, sizeof(*thr_traces));
+	batch_ctls = calloc(opt_n_threads, sizeof(*batch_ctls));
+	for (i = 0; i < opt_n_threads; i++)
+		batch_ctls[i].scale = 1;
+	job_hazards = calloc(opt_n_threads, sizeof(*job_hazards));
+	placement_init();
+	throttle_active = opt_n_threads;
 	devstrs = (char **)malloc(sizeof(char *) * opt_n_threads);
 
-	InitCUDA(opt_n_threads, devstrs);
+	if (!scan_dev->init(opt_n_threads, devstrs))
+		return 1;
 
 	/* init workio thread info */
 	work_thr_id = opt_n_threads;
@@ -2214,6 +4743,40 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	if (!opt_benchmark)
+	{
+		pthread_t save_thr;
+
+		/* start scratchpad writer thread */
+		if (pthread_create(&save_thr, NULL, scratchpad_save_thread, NULL)) {
+			applog(LOG_ERR, "scratchpad writer thread create failed");
+			return 1;
+		}
+		pthread_detach(save_thr);
+	}
+
+	if (opt_api_bind && !api_start(opt_api_bind))
+		return 1;
+
+	if (throttle_enabled()) {
+		pthread_t throttle_thr;
+
+		if (pthread_create(&throttle_thr, NULL, throttle_thread, NULL)) {
+			applog(LOG_ERR, "throttle thread create failed");
+			return 1;
+		}
+		pthread_detach(throttle_thr);
+	}
+
+	if (opt_proxy_listen) {
+		if (!have_stratum) {
+			applog(LOG_ERR, "--proxy-listen needs a stratum+tcp:// pool");
+			return 1;
+		}
+		if (!proxy_start(opt_proxy_listen))
+			return 1;
+	}
+
 	if (want_stratum && !opt_benchmark)
 	{
 		/* init stratum thread info */
@@ -2234,6 +4797,15 @@ int main(int argc, char *argv[]) {
 			tq_push(thr_info[stratum_thr_id].q, strdup(rpc_url));
 	}
 
+	if (opt_benchmark) {
+		/* the miners hash a blank job */
+		struct job_trace trace;
+
+		memset(&trace, 0, sizeof(trace));
+		gettimeofday(&trace.published, NULL);
+		job_publish(&g_work, &trace, stratum, 0);
+	}
+
 	/* start mining threads */
 	for (i = 0; i < opt_n_threads; i++) {
 		thr = &thr_info[i];
@@ -2250,7 +4822,8 @@ int main(int argc, char *argv[]) {
 	}
 
 	applog(LOG_INFO, "%d miner threads started, "
-		"using '%s' algorithm.", opt_n_threads, algo_names[opt_algo]);
+		"using '%s' algorithm on %s (%ux%u).", opt_n_threads, algo_names[opt_algo],
+		scan_dev->name, CUDABlocks, CUDAThreads);
 
 	/* main loop - simply wait for workio thread to exit */
 	pthread_join(thr_info[work_thr_id].pth, NULL );
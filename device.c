@@ -0,0 +1,73 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Scan backends. Besides CUDA (wildkeccak.cu) there is a CPU emulator that
+ * runs the same pipeline on the host with wild_keccak_hash_dbl(), so that
+ * batching, job switches and share handling can be tried and benchmarked
+ * without a GPU. Builds without nvcc (make cpu) only have the emulator.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "miner.h"
+
+static bool cpu_init(uint32_t threads, char **devstrs)
+{
+	uint32_t i;
+
+	for (i = 0; i < threads; i++)
+		devstrs[i] = strdup("CPU emulator");
+	return true;
+}
+
+static void cpu_attach(uint32_t thr_id)
+{
+}
+
+/* the emulator hashes straight out of pscratchpad_buff */
+static void cpu_upload(uint32_t threads, uint64_t start, uint64_t count)
+{
+}
+
+static const struct scan_device cpu_device = {
+	"cpu", 1, 256,
+	cpu_init, cpu_attach, cpu_upload, scanhash_wildkeccak_cpu
+};
+
+#ifndef NO_CUDA
+extern const struct scan_device cuda_device;
+#endif
+
+static const struct scan_device *const scan_devices[] = {
+#ifndef NO_CUDA
+	&cuda_device,
+#endif
+	&cpu_device,
+};
+
+#ifndef NO_CUDA
+const struct scan_device *scan_dev = &cuda_device;
+#else
+const struct scan_device *scan_dev = &cpu_device;
+#endif
+
+bool scan_device_select(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(scan_devices); i++) {
+		if (!strcasecmp(name, scan_devices[i]->name)) {
+			scan_dev = scan_devices[i];
+			return true;
+		}
+	}
+	return false;
+}
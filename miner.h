@@ -143,7 +143,45 @@ static inline void le32enc(void *pp, uint32_t x)
 
 //extern void wild_keccak_hash_dbl(uint8_t *md, const uint8_t *in, const uint64_t *scratchpad, uint64_t scr_size);
 extern void wild_keccak_hash_dbl(uint8_t *md, const uint8_t *in);
-extern int scanhash_wildkeccak(int thr_id, uint32_t *pdata, const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done);
+
+/*
+ * Candidates of one scan call. The scanner appends every nonce that meets
+ * the target; count goes on past SCAN_RESULTS_MAX so that candidates which
+ * did not fit still show up.
+ */
+#define SCAN_RESULTS_MAX	15
+
+struct scan_results {
+    uint32_t count;
+    uint32_t nonce[SCAN_RESULTS_MAX];
+};
+
+extern int scanhash_wildkeccak_cpu(int thr_id, uint32_t *pdata, const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done, struct scan_results *res);
+
+/*
+ * A scan backend, picked with --device. Miner thread thr_id drives device
+ * thr_id; blocks x threads is the launch config used without -l.
+ */
+struct scan_device {
+    const char *name;
+    unsigned int blocks, threads;
+    /* fills in devstrs for the first threads devices, false without them */
+    bool (*init)(uint32_t threads, char **devstrs);
+    /* on the miner thread, before its first scan */
+    void (*attach)(uint32_t thr_id);
+    /* copies scratchpad words [start, start + count) to the devices */
+    void (*upload)(uint32_t threads, uint64_t start, uint64_t count);
+    /*
+     * Launches scans of the low nonce word from pdata's on up to max_nonce
+     * and polls their results into res, stopping early on a restart or once
+     * res is full. Leaves pdata's nonce at the first one not scanned and
+     * returns how many candidates res holds.
+     */
+    int (*scan)(int thr_id, uint32_t *pdata, const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done, struct scan_results *res);
+};
+
+extern const struct scan_device *scan_dev;
+extern bool scan_device_select(const char *name);
 
 
 struct thr_info {
@@ -159,6 +197,7 @@ struct work_restart {
 
 extern bool opt_debug;
 extern bool opt_protocol;
+extern int opt_submit_window;
 extern bool opt_redirect;
 extern int opt_timeout;
 extern bool want_longpoll;
@@ -217,11 +256,43 @@ extern void applog(int prio, const char *fmt, ...);
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
                              const char *rpc_req, int *curl_err, int flags);
 extern char *bin2hex(const unsigned char *p, size_t len);
+extern void bin2hex_str(char *s, const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 extern size_t hex2bin_len(unsigned char *p, const char *hexstr, size_t len);
 extern int timeval_subtract(struct timeval *result, struct timeval *x,
 struct timeval *y);
 extern bool fulltest(const uint32_t *hash, const uint32_t *target);
+
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(40 * HIST_SUB)
+
+/* microsecond latency histogram, see hist_record() */
+struct latency_hist {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+extern void hist_record(struct latency_hist *h, uint64_t us);
+extern void hist_record_since(struct latency_hist *h, const struct timeval *start);
+extern uint64_t hist_percentile(const struct latency_hist *h, double pct);
+extern void hist_summary(const struct latency_hist *h, char *buf, size_t len);
+extern json_t *hist_json(const struct latency_hist *h);
+
+/* stats endpoint (api.c) */
+extern char *stats_json(void);
+extern bool api_start(const char *bind);
+extern int net_listen(const char *bind, const char *what);
+
+/* proxy mode (proxy.c) */
+extern const char *get_json_string_param(const json_t *val, const char *param_name);
+extern bool parse_height_info(const json_t *hi_section, struct scratchpad_hi *phi);
+extern json_t *proxy_job_json(uint8_t nonce_prefix, struct scratchpad_hi *hi);
+extern json_t *proxy_scratchpad_json(struct scratchpad_hi *hi);
+extern bool proxy_start(const char *bind);
+extern void proxy_notify_job(void);
 extern void diff_to_target(uint32_t *target, double diff);
 extern bool rpc2_getfullscratchpad_decode(const json_t *val);
 
@@ -250,6 +321,40 @@ struct stratum_job {
     double diff;
 };
 
+#define SUBMIT_BATCH_MAX	16
+#define SUBMIT_LINE_MAX		512
+
+/* a job as the pool sends it, decoded into fixed-size fields */
+struct rpc2_job {
+    unsigned char blob[128];
+    size_t bloblen;
+    char job_id[64];
+    uint32_t target;
+};
+
+/* a reply reduced to what submit and keepalived look at */
+struct stratum_status {
+    const char *status;		/* result.status, NULL if absent */
+    const char *error;		/* error message, NULL if no error */
+    bool lost;			/* connection dropped before a reply came */
+};
+
+struct stratum_ctx;
+typedef void (*stratum_reply_cb)(struct stratum_ctx *sctx, json_t *val, void *arg);
+typedef void (*stratum_status_cb)(struct stratum_ctx *sctx, const struct stratum_status *st, void *arg);
+
+struct stratum_request {
+    unsigned int id;
+    const char *method;
+    time_t deadline;
+    struct timeval sent;
+    stratum_reply_cb cb;
+    stratum_status_cb status_cb;	/* instead of cb: status-only replies */
+    void *arg;
+    bool prealloc;	/* owned by the caller, not freed by the table */
+    struct stratum_request *next;
+};
+
 struct stratum_ctx {
     char *url;
 
@@ -259,8 +364,51 @@ struct stratum_ctx {
     curl_socket_t sock;
     size_t sockbuf_size;
     char *sockbuf;
+    size_t sockbuf_start;	/* first unconsumed byte */
+    size_t sockbuf_scan;	/* newline search resumes here */
+    size_t sockbuf_len;		/* end of received data */
+    struct timeval line_rx;	/* when the last line was completed */
     pthread_mutex_t sock_lock;
 
+    /* event loop: outgoing lines are queued in wbuf and flushed whenever
+     * the socket is writable; other threads kick the loop via wakefd */
+    bool evloop_ready;
+    int epfd;
+    int wakefd[2];
+    bool want_out;
+    char *wbuf;
+    size_t wbuf_len;
+    size_t wbuf_size;
+
+    /* failover: a standby session stays logged in but ignores jobs */
+    bool standby;
+    volatile bool interrupted;
+
+    /* requests awaiting a reply, matched by id */
+    pthread_mutex_t req_lock;
+    unsigned int next_req_id;
+    struct stratum_request *inflight;
+
+    /* shares waiting for the submit window to close, sent with one writev */
+    char subq[SUBMIT_BATCH_MAX][SUBMIT_LINE_MAX];
+    size_t subq_len[SUBMIT_BATCH_MAX];
+    int subq_n;
+    struct timeval subq_first;
+    unsigned long batches;
+    unsigned long batched_shares;
+    int batch_max;
+    struct latency_hist lat_batch_wait;
+
+    /* received lines by decoder: schema-specific fast path or jansson */
+    unsigned long fast_lines;
+    unsigned long json_lines;
+
+    /* request round trips and job arrival to first hash */
+    struct latency_hist lat_submit;
+    struct latency_hist lat_getjob;
+    struct latency_hist lat_login;
+    struct latency_hist lat_job_start;
+
     double next_diff;
 
     char *session_id;
@@ -274,22 +422,34 @@ struct stratum_ctx {
 
 bool stratum_keepalived(struct stratum_ctx *sctx , const char *rpc2_id);
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout);
+int stratum_poll(struct stratum_ctx *sctx, int timeout_ms);
+int stratum_wait(struct stratum_ctx *sctx, int timeout_ms);
+void stratum_interrupt(struct stratum_ctx *sctx);
 bool stratum_send_line(struct stratum_ctx *sctx, char *s);
 char *stratum_recv_line(struct stratum_ctx *sctx);
+unsigned int stratum_send_request(struct stratum_ctx *sctx, const char *method,
+                                  const char *params, int timeout,
+                                  stratum_reply_cb cb, void *arg);
+unsigned int stratum_submit(struct stratum_ctx *sctx, struct stratum_request *req,
+                            const char *params, int timeout,
+                            stratum_status_cb cb, void *arg);
+bool stratum_dispatch_response(struct stratum_ctx *sctx, json_t *val);
+void stratum_expire_requests(struct stratum_ctx *sctx, time_t now);
+time_t stratum_requests_deadline(struct stratum_ctx *sctx);
+bool stratum_handle_line(struct stratum_ctx *sctx, const char *s);
 bool stratum_connect(struct stratum_ctx *sctx, const char *url);
 void stratum_disconnect(struct stratum_ctx *sctx);
 bool stratum_subscribe(struct stratum_ctx *sctx);
 bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *pass);
 bool stratum_handle_method(struct stratum_ctx *sctx, const char *s);
 
-void UpdateScratchpad(uint32_t threads);
-void InitCUDA(uint32_t threads, char **devstrs);
-void CUDASetDevice(uint32_t thread_id);
-
 extern bool stratum_getscratchpad(struct stratum_ctx *sctx);
 extern bool stratum_request_job(struct stratum_ctx *sctx);
+extern bool proxy_submit_upstream(const char *job_id, const char *nonce, const char *result,
+				  stratum_status_cb cb, void *arg);
 
 extern bool rpc2_job_decode(const json_t *job, struct work *work);
+extern bool rpc2_job_apply(const struct rpc2_job *job, struct work *work);
 extern bool rpc2_login_decode(const json_t *val);
 
 struct thread_q;
@@ -300,5 +460,6 @@ extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
+extern void tq_bench(void);
 
 #endif /* __MINER_H__ */
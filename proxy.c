@@ -0,0 +1,498 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Proxy mode: serves the upstream session to local miners in the same
+ * JSON-RPC 2.0 dialect the pool speaks (login, getjob, getfullscratchpad,
+ * submit, keepalived and pushed job notifications with addendums). Only
+ * this process keeps an upstream connection and downloads the scratchpad;
+ * local miners get it from here, then follow it through addendums rebuilt
+ * from the addendum history.
+ *
+ * Each client gets a distinct top nonce byte in its blob so that no two
+ * rigs (nor this process' own GPUs, which keep the upstream byte) search
+ * the same nonces. Shares are forwarded upstream and the pool's verdict is
+ * relayed back to the client that found them.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "compat.h"
+#include "miner.h"
+
+#define PROXY_MAX_CLIENTS	254
+#define PROXY_LINE_MAX		(64 * 1024)
+#define PROXY_IDLE_TIMEOUT	(15 * 60)
+
+struct proxy_client {
+	bool in_use;
+	int fd;
+	int wakefd[2];
+	unsigned int gen;		/* bumped per connection, guards late replies */
+	pthread_mutex_t lock;		/* serializes writes to fd */
+
+	bool logged_in;
+	char session[32];
+	struct scratchpad_hi hi;	/* scratchpad height the miner has */
+	unsigned int job_seq;		/* last job pushed */
+
+	char *rbuf;
+	size_t rlen;
+
+	struct proxy_share *verdicts;	/* answered shares to relay, under proxy_lock */
+};
+
+/* a forwarded share waiting for the upstream verdict */
+struct proxy_share {
+	int slot;
+	unsigned int gen;
+	json_t *id;
+
+	/* the verdict, filled in on the upstream thread */
+	char *error;			/* NULL if accepted */
+	char *status;
+	struct proxy_share *next;
+};
+
+static struct proxy_client clients[PROXY_MAX_CLIENTS];
+static pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile unsigned int proxy_job_seq;
+static int proxy_sock = -1;
+
+/* slot 0 is this process, clients use the next prefix bytes */
+static uint8_t proxy_nonce_prefix(struct proxy_client *c)
+{
+	return (uint8_t) (c - clients + 1);
+}
+
+static bool proxy_send(struct proxy_client *c, json_t *val)
+{
+	char *s = json_dumps(val, 0), *line;
+	size_t len, off = 0;
+	bool ret = true;
+
+	if (!s)
+		return false;
+	len = strlen(s);
+	line = realloc(s, len + 1);
+	if (!line) {
+		free(s);
+		return false;
+	}
+	s = line;
+	s[len++] = '\n';
+
+	pthread_mutex_lock(&c->lock);
+	while (off < len) {
+		ssize_t n = send(c->fd, s + off, len - off, MSG_NOSIGNAL);
+		if (n <= 0) {
+			ret = false;
+			break;
+		}
+		off += n;
+	}
+	pthread_mutex_unlock(&c->lock);
+	free(s);
+	return ret;
+}
+
+static bool proxy_reply(struct proxy_client *c, json_t *id, json_t *result, const char *error)
+{
+	json_t *val = json_object();
+	bool ret;
+
+	json_object_set(val, "id", id ? id : json_null());
+	json_object_set_new(val, "jsonrpc", json_string("2.0"));
+	if (error) {
+		json_t *err = json_object();
+		json_object_set_new(err, "code", json_integer(-1));
+		json_object_set_new(err, "message", json_string(error));
+		json_object_set_new(val, "error", err);
+		if (result)
+			json_decref(result);
+	} else {
+		json_object_set_new(val, "error", json_null());
+		json_object_set_new(val, "result", result);
+	}
+	ret = proxy_send(c, val);
+	json_decref(val);
+	return ret;
+}
+
+static json_t *proxy_client_job(struct proxy_client *c)
+{
+	c->job_seq = proxy_job_seq;
+	return proxy_job_json(proxy_nonce_prefix(c), &c->hi);
+}
+
+static void proxy_share_free(struct proxy_share *share)
+{
+	json_decref(share->id);
+	free(share->error);
+	free(share->status);
+	free(share);
+}
+
+/*
+ * Runs on the upstream stratum thread, which must not wait on a client
+ * socket: the verdict is queued and relayed by the client's own thread.
+ */
+static void proxy_submit_done(struct stratum_ctx *sctx, const struct stratum_status *st, void *arg)
+{
+	struct proxy_share *share = arg;
+	struct proxy_client *c = &clients[share->slot];
+
+	if (!st || st->lost)
+		share->error = strdup("No reply from upstream pool");
+	else if (st->error)
+		share->error = strdup(st->error);
+	else
+		share->status = strdup(st->status ? st->status : "OK");
+
+	pthread_mutex_lock(&proxy_lock);
+	if (c->in_use && c->gen == share->gen) {
+		share->next = c->verdicts;
+		c->verdicts = share;
+		share = NULL;
+		if (write(c->wakefd[1], "", 1) < 0 && errno != EAGAIN)
+			applog(LOG_DEBUG, "proxy: wakeup of client #%d failed", (int) (c - clients));
+	}
+	pthread_mutex_unlock(&proxy_lock);
+
+	if (share)
+		proxy_share_free(share);
+}
+
+/* relays the verdicts queued by proxy_submit_done(), oldest first */
+static bool proxy_send_verdicts(struct proxy_client *c)
+{
+	struct proxy_share *list, *rev = NULL, *share;
+	bool ret = true;
+
+	pthread_mutex_lock(&proxy_lock);
+	list = c->verdicts;
+	c->verdicts = NULL;
+	pthread_mutex_unlock(&proxy_lock);
+
+	while ((share = list)) {
+		list = share->next;
+		share->next = rev;
+		rev = share;
+	}
+	while ((share = rev)) {
+		rev = share->next;
+		if (ret && share->error)
+			ret = proxy_reply(c, share->id, NULL, share->error);
+		else if (ret) {
+			json_t *res = json_object();
+			json_object_set_new(res, "status", json_string(share->status ? share->status : "OK"));
+			ret = proxy_reply(c, share->id, res, NULL);
+		}
+		proxy_share_free(share);
+	}
+	return ret;
+}
+
+static void proxy_handle_submit(struct proxy_client *c, json_t *id, json_t *params)
+{
+	const char *job_id = get_json_string_param(params, "job_id");
+	const char *nonce = get_json_string_param(params, "nonce");
+	const char *result = get_json_string_param(params, "result");
+	struct proxy_share *share;
+	unsigned char prefix;
+
+	if (!job_id || !nonce || !result || strlen(nonce) != 16 || !hex2bin(&prefix, nonce + 14, 1)) {
+		proxy_reply(c, id, NULL, "Invalid share");
+		return;
+	}
+	if (prefix != proxy_nonce_prefix(c)) {
+		proxy_reply(c, id, NULL, "Nonce outside assigned range");
+		return;
+	}
+
+	share = calloc(1, sizeof(*share));
+	if (!share) {
+		proxy_reply(c, id, NULL, "Out of memory");
+		return;
+	}
+	share->slot = c - clients;
+	share->gen = c->gen;
+	share->id = json_incref(id ? id : json_null());
+	if (!proxy_submit_upstream(job_id, nonce, result, proxy_submit_done, share)) {
+		proxy_share_free(share);
+		proxy_reply(c, id, NULL, "Upstream pool unavailable");
+	}
+}
+
+static bool proxy_handle_line(struct proxy_client *c, const char *line)
+{
+	json_t *val, *id, *params, *hi;
+	json_error_t err;
+	const char *method;
+	bool ret = true;
+
+	val = JSON_LOADS(line, &err);
+	if (!val) {
+		applog(LOG_ERR, "proxy: client #%d sent invalid JSON", (int) (c - clients));
+		return false;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	id = json_object_get(val, "id");
+	params = json_object_get(val, "params");
+	if (!method) {
+		json_decref(val);
+		return true;	/* a reply to nothing we asked */
+	}
+
+	hi = json_object_get(params, "hi");
+	if (hi && !parse_height_info(hi, &c->hi))
+		memset(&c->hi, 0, sizeof(c->hi));
+
+	if (!strcmp(method, "login")) {
+		json_t *job = proxy_client_job(c), *res;
+
+		if (!job) {
+			ret = proxy_reply(c, id, NULL, "No job from upstream pool yet");
+		} else {
+			c->logged_in = true;
+			res = json_object();
+			json_object_set_new(res, "id", json_string(c->session));
+			json_object_set_new(res, "job", job);
+			json_object_set_new(res, "status", json_string("OK"));
+			ret = proxy_reply(c, id, res, NULL);
+			applog(LOG_INFO, "proxy: client #%d logged in as %s (nonce prefix %02x)",
+				(int) (c - clients), get_json_string_param(params, "login"), proxy_nonce_prefix(c));
+		}
+	} else if (!c->logged_in) {
+		ret = proxy_reply(c, id, NULL, "Unauthenticated");
+	} else if (!strcmp(method, "getjob")) {
+		json_t *job = proxy_client_job(c);
+		ret = proxy_reply(c, id, job, job ? NULL : "No job from upstream pool yet");
+	} else if (!strcmp(method, "getfullscratchpad")) {
+		json_t *res = proxy_scratchpad_json(&c->hi);
+		ret = proxy_reply(c, id, res, res ? NULL : "Scratchpad not available yet");
+	} else if (!strcmp(method, "submit")) {
+		proxy_handle_submit(c, id, params);
+	} else if (!strcmp(method, "keepalived")) {
+		json_t *res = json_object();
+		json_object_set_new(res, "status", json_string("KEEPALIVED"));
+		ret = proxy_reply(c, id, res, NULL);
+	} else {
+		ret = proxy_reply(c, id, NULL, "Unknown method");
+	}
+
+	json_decref(val);
+	return ret;
+}
+
+static bool proxy_push_job(struct proxy_client *c)
+{
+	json_t *val, *job = proxy_client_job(c);
+	bool ret;
+
+	if (!job)
+		return true;
+	val = json_object();
+	json_object_set_new(val, "jsonrpc", json_string("2.0"));
+	json_object_set_new(val, "method", json_string("job"));
+	json_object_set_new(val, "params", job);
+	ret = proxy_send(c, val);
+	json_decref(val);
+	return ret;
+}
+
+/* reads what is there and handles every complete line */
+static bool proxy_read(struct proxy_client *c)
+{
+	char *nl, *line;
+	ssize_t n;
+
+	n = recv(c->fd, c->rbuf + c->rlen, PROXY_LINE_MAX - c->rlen, 0);
+	if (n <= 0)
+		return n < 0 && (errno == EAGAIN || errno == EINTR);
+	c->rlen += n;
+
+	line = c->rbuf;
+	while ((nl = memchr(line, '\n', c->rbuf + c->rlen - line))) {
+		*nl = '\0';
+		if (nl > line && !proxy_handle_line(c, line))
+			return false;
+		line = nl + 1;
+	}
+	c->rlen -= line - c->rbuf;
+	memmove(c->rbuf, line, c->rlen);
+	if (c->rlen == PROXY_LINE_MAX) {
+		applog(LOG_ERR, "proxy: client #%d line too long", (int) (c - clients));
+		return false;
+	}
+	return true;
+}
+
+static void *proxy_client_thread(void *userdata)
+{
+	struct proxy_client *c = userdata;
+	struct proxy_share *share;
+	time_t last_rx = time(NULL);
+	char buf[64];
+
+	while (1) {
+		struct pollfd fds[2] = {
+			{ .fd = c->fd, .events = POLLIN },
+			{ .fd = c->wakefd[0], .events = POLLIN },
+		};
+		int rc = poll(fds, 2, 60 * 1000);
+
+		if (rc < 0 && errno != EINTR)
+			break;
+		if (fds[1].revents & POLLIN) {
+			while (read(c->wakefd[0], buf, sizeof(buf)) > 0);
+			if (!proxy_send_verdicts(c))
+				break;
+			if (c->logged_in && c->job_seq != proxy_job_seq && !proxy_push_job(c))
+				break;
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (!proxy_read(c))
+				break;
+			last_rx = time(NULL);
+		} else if (time(NULL) - last_rx > PROXY_IDLE_TIMEOUT) {
+			applog(LOG_INFO, "proxy: client #%d idle, dropping", (int) (c - clients));
+			break;
+		}
+	}
+
+	applog(LOG_INFO, "proxy: client #%d disconnected", (int) (c - clients));
+	pthread_mutex_lock(&proxy_lock);
+	c->in_use = false;
+	c->gen++;
+	while ((share = c->verdicts)) {
+		c->verdicts = share->next;
+		proxy_share_free(share);
+	}
+	close(c->fd);
+	close(c->wakefd[0]);
+	close(c->wakefd[1]);
+	free(c->rbuf);
+	c->rbuf = NULL;
+	pthread_mutex_unlock(&proxy_lock);
+	return NULL;
+}
+
+static void *proxy_accept_thread(void *userdata)
+{
+	while (1) {
+		struct proxy_client *c = NULL;
+		struct timeval tv = { 5, 0 };
+		pthread_t pth;
+		int fd, i;
+
+		fd = accept(proxy_sock, NULL, NULL);
+		if (fd < 0) {
+			/* out of descriptors and the like: don't spin on it */
+			if (errno != EINTR && errno != ECONNABORTED) {
+				applog(LOG_ERR, "proxy: accept failed: %s", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&proxy_lock);
+		for (i = 0; i < PROXY_MAX_CLIENTS && !c; i++) {
+			if (!clients[i].in_use)
+				c = &clients[i];
+		}
+		if (c) {
+			c->rbuf = malloc(PROXY_LINE_MAX);
+			if (!c->rbuf || pipe(c->wakefd)) {
+				free(c->rbuf);
+				c->rbuf = NULL;
+				c = NULL;
+			}
+		}
+		if (!c) {
+			pthread_mutex_unlock(&proxy_lock);
+			applog(LOG_ERR, "proxy: no room for another client");
+			close(fd);
+			continue;
+		}
+		fcntl(c->wakefd[0], F_SETFL, O_NONBLOCK);
+		fcntl(c->wakefd[1], F_SETFL, O_NONBLOCK);
+		/* a stuck client must not stall the threads that push to it */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *) &tv, sizeof(tv));
+		c->fd = fd;
+		c->rlen = 0;
+		c->logged_in = false;
+		c->job_seq = 0;
+		memset(&c->hi, 0, sizeof(c->hi));
+		snprintf(c->session, sizeof(c->session), "proxy-%d-%u", (int) (c - clients), c->gen);
+		c->in_use = true;
+		pthread_mutex_unlock(&proxy_lock);
+
+		if (pthread_create(&pth, NULL, proxy_client_thread, c)) {
+			pthread_mutex_lock(&proxy_lock);
+			c->in_use = false;
+			close(fd);
+			close(c->wakefd[0]);
+			close(c->wakefd[1]);
+			free(c->rbuf);
+			c->rbuf = NULL;
+			pthread_mutex_unlock(&proxy_lock);
+			continue;
+		}
+		pthread_detach(pth);
+		applog(LOG_INFO, "proxy: client #%d connected", (int) (c - clients));
+	}
+	return NULL;
+}
+
+/* called by the stratum thread whenever the upstream job changes */
+void proxy_notify_job(void)
+{
+	int i;
+
+	if (proxy_sock < 0)
+		return;
+	proxy_job_seq++;
+	pthread_mutex_lock(&proxy_lock);
+	for (i = 0; i < PROXY_MAX_CLIENTS; i++) {
+		if (clients[i].in_use && write(clients[i].wakefd[1], "", 1) < 0 && errno != EAGAIN)
+			applog(LOG_DEBUG, "proxy: wakeup of client #%d failed", i);
+	}
+	pthread_mutex_unlock(&proxy_lock);
+}
+
+bool proxy_start(const char *bind_str)
+{
+	pthread_t pth;
+	int i;
+
+	for (i = 0; i < PROXY_MAX_CLIENTS; i++)
+		pthread_mutex_init(&clients[i].lock, NULL);
+
+	proxy_sock = net_listen(bind_str, "stratum proxy");
+	if (proxy_sock < 0)
+		return false;
+	if (pthread_create(&pth, NULL, proxy_accept_thread, NULL)) {
+		applog(LOG_ERR, "proxy thread create failed");
+		close(proxy_sock);
+		proxy_sock = -1;
+		return false;
+	}
+	pthread_detach(pth);
+	return true;
+}
@@ -30,7 +30,15 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #endif
+#ifdef __linux
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include <limits.h>
 #include "compat.h"
 #include "miner.h"
 #include "elist.h"
@@ -52,18 +60,49 @@ struct header_info {
     char		*stratum_url;
 };
 
-struct tq_ent {
-    void			*data;
-    struct list_head	q_node;
+/*
+ * Thread queues are bounded rings of pointers (Vyukov's bounded queue):
+ * any number of threads push, one thread pops. Pushing is a CAS on head
+ * plus two stores and never allocates; a consumer that finds the ring
+ * empty sleeps on a futex (a condition variable off Linux), and producers
+ * only make a system call while it does. A full ring blocks producers the
+ * same way until the consumer has drained half of it.
+ *
+ * The ring does not win everywhere: with many more producers than CPUs,
+ * CAS retries pile up and a producer preempted between claiming a slot
+ * and filling it stalls the consumer, so at 16 producers on one core
+ * --queue-bench shows it at or below the mutex list, which parks the
+ * losers in the kernel instead. The queues here have a handful of
+ * producers (one per GPU plus the service threads), where the ring is
+ * well ahead and a share push never allocates.
+ */
+#define TQ_SIZE		1024	/* power of two */
+#define TQ_LINE		64
+
+struct tq_cell {
+    volatile unsigned long seq;
+    void *data;
 };
 
 struct thread_q {
-    struct list_head	q;
-
-    bool frozen;
-
-    pthread_mutex_t		mutex;
-    pthread_cond_t		cond;
+    struct tq_cell *cells;
+    unsigned long mask;
+    char pad0[TQ_LINE];
+
+    volatile unsigned long head;	/* next slot to fill, producers */
+    char pad1[TQ_LINE - sizeof(unsigned long)];
+
+    volatile unsigned long tail;	/* next slot to drain, consumer */
+    volatile int sleeping;		/* consumer waits for wake_seq to move */
+    volatile int wake_seq;
+    volatile int full;			/* producers wait for space_seq to move */
+    volatile int space_seq;
+    volatile bool frozen;
+#ifndef __linux
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+    char pad2[TQ_LINE];
 };
 
 void applog(int prio, const char *fmt, ...)
@@ -442,16 +481,26 @@ err_out:
     return NULL;
 }
 
+/* hex-encodes len bytes into s, which must hold len * 2 + 1 chars */
+void bin2hex_str(char *s, const unsigned char *p, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        s[i * 2] = digits[p[i] >> 4];
+        s[i * 2 + 1] = digits[p[i] & 0xf];
+    }
+    s[len * 2] = '\0';
+}
+
 char *bin2hex(const unsigned char *p, size_t len)
 {
-    int i;
     char *s = malloc((len * 2) + 1);
     if (!s)
         return NULL;
 
-    for (i = 0; i < len; i++)
-        sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
-
+    bin2hex_str(s, p, len);
     return s;
 }
 
@@ -538,6 +587,99 @@ struct timeval *y)
     return x->tv_sec < y->tv_sec;
 }
 
+/*
+ * Latency histograms, HDR style: values below HIST_SUB are exact, above that
+ * every power of two is split into HIST_SUB linear buckets, so any reported
+ * value is within 1/HIST_SUB of what was recorded. Recording is lock-free.
+ */
+static int hist_index(uint64_t v)
+{
+    int shift, idx;
+
+    if (v < HIST_SUB)
+        return (int) v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    idx = shift * HIST_SUB + (int) (v >> shift);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_value(int idx)
+{
+    int shift;
+
+    if (idx < HIST_SUB)
+        return idx;
+    shift = idx / HIST_SUB - 1;
+    return ((uint64_t) (idx % HIST_SUB + HIST_SUB) << shift) + ((1ULL << shift) >> 1);
+}
+
+void hist_record(struct latency_hist *h, uint64_t us)
+{
+    uint64_t max = h->max_us;
+
+    __sync_fetch_and_add(&h->buckets[hist_index(us)], 1);
+    __sync_fetch_and_add(&h->sum_us, us);
+    __sync_fetch_and_add(&h->count, 1);
+    while (us > max && !__sync_bool_compare_and_swap(&h->max_us, max, us))
+        max = h->max_us;
+}
+
+void hist_record_since(struct latency_hist *h, const struct timeval *start)
+{
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    if (timeval_subtract(&diff, &now, (struct timeval *) start))
+        return;
+    hist_record(h, (uint64_t) diff.tv_sec * 1000000 + diff.tv_usec);
+}
+
+/* value at percentile pct (0-100), in microseconds */
+uint64_t hist_percentile(const struct latency_hist *h, double pct)
+{
+    uint64_t want, seen = 0;
+    int i;
+
+    if (!h->count)
+        return 0;
+    want = (uint64_t) (h->count * pct / 100.0 + 0.5);
+    if (!want)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want)
+            return hist_value(i) < h->max_us ? hist_value(i) : h->max_us;
+    }
+    return h->max_us;
+}
+
+/* one-line summary in milliseconds for periodic logs */
+void hist_summary(const struct latency_hist *h, char *buf, size_t len)
+{
+    if (!h->count) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    snprintf(buf, len, "%.1f/%.1f/%.1f/%.1f ms (n=%llu)",
+             hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+             hist_percentile(h, 99) / 1e3, h->max_us / 1e3,
+             (unsigned long long) h->count);
+}
+
+json_t *hist_json(const struct latency_hist *h)
+{
+    json_t *val = json_object();
+
+    json_object_set_new(val, "count", json_integer(h->count));
+    json_object_set_new(val, "mean_ms", json_real(h->count ? h->sum_us / 1e3 / h->count : 0.0));
+    json_object_set_new(val, "p50_ms", json_real(hist_percentile(h, 50) / 1e3));
+    json_object_set_new(val, "p90_ms", json_real(hist_percentile(h, 90) / 1e3));
+    json_object_set_new(val, "p99_ms", json_real(hist_percentile(h, 99) / 1e3));
+    json_object_set_new(val, "p999_ms", json_real(hist_percentile(h, 99.9) / 1e3));
+    json_object_set_new(val, "max_ms", json_real(h->max_us / 1e3));
+    return val;
+}
+
 bool fulltest(const uint32_t *hash, const uint32_t *target)
 {
     int i;
@@ -601,248 +743,838 @@ void diff_to_target(uint32_t *target, double diff)
 #define socket_blocks() (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
 
-static bool send_line(curl_socket_t sock, char *s)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define RBUFSIZE 2048
+#define RECVSIZE_MIN (256 * 1024)
+#define WBUF_MAX (16 * 1024 * 1024)
+
+static void stratum_evloop_init(struct stratum_ctx *sctx)
 {
-    ssize_t len, sent = 0;
+    if (sctx->evloop_ready)
+        return;
+#ifndef WIN32
+    if (pipe(sctx->wakefd) == 0) {
+        fcntl(sctx->wakefd[0], F_SETFL, O_NONBLOCK);
+        fcntl(sctx->wakefd[1], F_SETFL, O_NONBLOCK);
+    } else
+#endif
+        sctx->wakefd[0] = sctx->wakefd[1] = -1;
+#ifdef __linux
+    sctx->epfd = epoll_create(2);
+    if (sctx->epfd >= 0 && sctx->wakefd[0] >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = sctx->wakefd[0] };
+        epoll_ctl(sctx->epfd, EPOLL_CTL_ADD, sctx->wakefd[0], &ev);
+    }
+#endif
+    sctx->evloop_ready = true;
+}
 
-    len = strlen(s);
-    s[len++] = '\n';
+/* wake the thread sleeping in stratum_poll() so it re-arms for output */
+static void stratum_evloop_kick(struct stratum_ctx *sctx)
+{
+#ifndef WIN32
+    if (sctx->evloop_ready && sctx->wakefd[1] >= 0) {
+        char c = 0;
+        if (write(sctx->wakefd[1], &c, 1) < 0 && !socket_blocks())
+            applog(LOG_DEBUG, "stratum wakeup failed: %s", strerror(errno));
+    }
+#endif
+}
 
-    while (len > 0) {
-        struct timeval timeout = {0, 0};
-        ssize_t n;
-        fd_set wd;
+static void stratum_evloop_drain(struct stratum_ctx *sctx)
+{
+#ifndef WIN32
+    char buf[64];
+    while (sctx->wakefd[0] >= 0 && read(sctx->wakefd[0], buf, sizeof(buf)) > 0)
+        ;
+#endif
+}
 
-        FD_ZERO(&wd);
-        FD_SET(sock, &wd);
-        if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
-            return false;
-        n = send(sock, s + sent, len, 0);
+/* send as much of the write queue as the socket takes without blocking;
+ * called with sock_lock held */
+static bool stratum_flush(struct stratum_ctx *sctx)
+{
+    size_t sent = 0;
+
+    while (sent < sctx->wbuf_len) {
+        ssize_t n = send(sctx->sock, sctx->wbuf + sent, sctx->wbuf_len - sent, MSG_NOSIGNAL);
         if (n < 0) {
-            if (!socket_blocks())
-                return false;
-            n = 0;
+            if (socket_blocks())
+                break;
+            if (errno == EINTR)
+                continue;
+            return false;
         }
         sent += n;
-        len -= n;
     }
+    if (sent) {
+        memmove(sctx->wbuf, sctx->wbuf + sent, sctx->wbuf_len - sent);
+        sctx->wbuf_len -= sent;
+    }
+    return true;
+}
 
+/* makes room for len more bytes in the write queue; called with sock_lock held */
+static bool stratum_wbuf_reserve(struct stratum_ctx *sctx, size_t len)
+{
+    size_t sz = sctx->wbuf_len + len + RBUFSIZE;
+    char *p;
+
+    if (sctx->wbuf_len + len <= sctx->wbuf_size)
+        return true;
+    if (sz > WBUF_MAX) {
+        applog(LOG_ERR, "stratum write queue overflow");
+        return false;
+    }
+    p = realloc(sctx->wbuf, sz);
+    if (!p)
+        return false;
+    sctx->wbuf = p;
+    sctx->wbuf_size = sz;
     return true;
 }
 
+/*
+ * Writes the write queue followed by the batched submits with one writev;
+ * whatever the socket does not take moves to the write queue, in order.
+ * Called with sock_lock held.
+ */
+static bool stratum_flush_submits(struct stratum_ctx *sctx)
+{
+    struct iovec iov[SUBMIT_BATCH_MAX + 1];
+    ssize_t sent = 0;
+    bool ret = true;
+    int i, n = 0;
+
+    if (!sctx->subq_n)
+        return true;
+
+    if (sctx->wbuf_len) {
+        iov[n].iov_base = sctx->wbuf;
+        iov[n++].iov_len = sctx->wbuf_len;
+    }
+    for (i = 0; i < sctx->subq_n; i++) {
+        iov[n].iov_base = sctx->subq[i];
+        iov[n++].iov_len = sctx->subq_len[i];
+    }
+#ifndef WIN32
+    do
+        sent = writev(sctx->sock, iov, n);
+    while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        ret = socket_blocks();
+        sent = 0;
+    }
+#endif
+
+    hist_record_since(&sctx->lat_batch_wait, &sctx->subq_first);
+    sctx->batches++;
+    sctx->batched_shares += sctx->subq_n;
+    if (sctx->subq_n > sctx->batch_max)
+        sctx->batch_max = sctx->subq_n;
+
+    i = 0;
+    if (sctx->wbuf_len) {
+        size_t done = (size_t) sent < sctx->wbuf_len ? (size_t) sent : sctx->wbuf_len;
+        memmove(sctx->wbuf, sctx->wbuf + done, sctx->wbuf_len - done);
+        sctx->wbuf_len -= done;
+        sent -= done;
+        i = 1;
+    }
+    for (; i < n; i++) {
+        size_t len = iov[i].iov_len;
+
+        if ((size_t) sent >= len) {
+            sent -= len;
+        } else {
+            if (ret && (ret = stratum_wbuf_reserve(sctx, len - sent))) {
+                memcpy(sctx->wbuf + sctx->wbuf_len, (char *) iov[i].iov_base + sent, len - sent);
+                sctx->wbuf_len += len - sent;
+            }
+            sent = 0;
+        }
+    }
+    sctx->subq_n = 0;
+    return ret;
+}
+
+/* queue a line for the pool; it is written right away if the socket takes
+ * it, otherwise the event loop finishes the job once it becomes writable */
 bool stratum_send_line(struct stratum_ctx *sctx, char *s)
 {
-    bool ret = false;
+    size_t len = strlen(s);
+    bool ret = false, pending;
 
     if (opt_protocol)
         applog(LOG_DEBUG, "> %s", s);
 
     pthread_mutex_lock(&sctx->sock_lock);
-    ret = send_line(sctx->sock, s);
+    if (!sctx->curl || !stratum_wbuf_reserve(sctx, len + 1))
+        goto out;
+    memcpy(sctx->wbuf + sctx->wbuf_len, s, len);
+    sctx->wbuf[sctx->wbuf_len + len] = '\n';
+    sctx->wbuf_len += len + 1;
+
+    ret = stratum_flush(sctx);
+    pending = sctx->wbuf_len > 0;
+out:
     pthread_mutex_unlock(&sctx->sock_lock);
 
+    if (ret && pending)
+        stratum_evloop_kick(sctx);
     return ret;
 }
 
-static bool socket_full(curl_socket_t sock, int timeout)
+/*
+ * In-flight requests. Every request gets a unique id and stays in the table
+ * until its reply arrives, it expires or the connection drops. The callback
+ * runs exactly once, with a NULL reply in the last two cases, so several
+ * submits and control calls can be pipelined on one connection.
+ */
+static struct stratum_request *stratum_take_request(struct stratum_ctx *sctx,
+                                                    unsigned int id)
 {
-    struct timeval tv;
-    fd_set rd;
+    struct stratum_request **pp, *req = NULL;
 
-    FD_ZERO(&rd);
-    FD_SET(sock, &rd);
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
-    if (select(sock + 1, &rd, NULL, NULL, &tv) > 0)
-        return true;
-    return false;
+    pthread_mutex_lock(&sctx->req_lock);
+    for (pp = &sctx->inflight; *pp; pp = &(*pp)->next) {
+        if ((*pp)->id == id) {
+            req = *pp;
+            *pp = req->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sctx->req_lock);
+    return req;
 }
 
-bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
+static void stratum_release_request(struct stratum_request *req)
 {
-    return strlen(sctx->sockbuf) || socket_full(sctx->sock, timeout);
+    if (req && !req->prealloc)
+        free(req);
 }
 
-#define RBUFSIZE 2048
-#define RECVSIZE (RBUFSIZE - 4)
+/*
+ * Runs the callback and releases the request; the callback may recycle a
+ * preallocated request, so it is not touched afterwards. Replies come
+ * either as JSON or, from the fast path, already reduced to a status.
+ */
+static void stratum_complete_request(struct stratum_ctx *sctx, struct stratum_request *req,
+                                     json_t *val, const struct stratum_status *st)
+{
+    bool prealloc = req->prealloc;
+    struct stratum_status jst = { NULL, NULL, false };
+
+    if (req->status_cb) {
+        if (val && !st) {
+            json_t *err = json_object_get(val, "error");
+
+            jst.status = json_string_value(json_object_get(json_object_get(val, "result"), "status"));
+            jst.error = NULL;
+            if (err && !json_is_null(err)) {
+                if (json_is_string(err))
+                    jst.error = json_string_value(err);
+                else
+                    jst.error = json_string_value(json_object_get(err, "message"));
+                if (!jst.error)
+                    jst.error = "unknown";
+            }
+            st = &jst;
+        }
+        req->status_cb(sctx, st, req->arg);
+    } else if (req->cb)
+        req->cb(sctx, val, req->arg);
+    if (!prealloc)
+        free(req);
+}
 
-static void stratum_buffer_append(struct stratum_ctx *sctx, const char *s)
+/*
+ * Adds a request to the in-flight table and returns its id, 0 on failure.
+ * req is caller storage that must outlive the request, or NULL to allocate.
+ */
+static unsigned int stratum_track_request(struct stratum_ctx *sctx,
+                                          struct stratum_request *req, const char *method,
+                                          int timeout, stratum_reply_cb cb,
+                                          stratum_status_cb status_cb, void *arg)
 {
-    size_t old, new;
+    unsigned int id;
 
-    old = strlen(sctx->sockbuf);
-    new = old + strlen(s) + 1;
-    if (new >= sctx->sockbuf_size) {
-        sctx->sockbuf_size = new + (RBUFSIZE - (new % RBUFSIZE));
-        sctx->sockbuf = realloc(sctx->sockbuf, sctx->sockbuf_size);
-    }
-    strcpy(sctx->sockbuf + old, s);
+    if (req) {
+        memset(req, 0, sizeof(*req));
+        req->prealloc = true;
+    } else if (!(req = calloc(1, sizeof(*req))))
+        return 0;
+
+    pthread_mutex_lock(&sctx->req_lock);
+    if (!++sctx->next_req_id)
+        ++sctx->next_req_id;
+    id = req->id = sctx->next_req_id;
+    req->method = method;
+    req->deadline = time(NULL) + timeout;
+    gettimeofday(&req->sent, NULL);
+    req->cb = cb;
+    req->status_cb = status_cb;
+    req->arg = arg;
+    req->next = sctx->inflight;
+    sctx->inflight = req;
+    pthread_mutex_unlock(&sctx->req_lock);
+    return id;
 }
 
-char *stratum_recv_line_timeout(struct stratum_ctx *sctx, int timeout_)
+static unsigned int stratum_send(struct stratum_ctx *sctx, const char *method,
+                                 const char *params, int timeout, stratum_reply_cb cb,
+                                 stratum_status_cb status_cb, void *arg)
 {
-    ssize_t len, buflen;
-    char *tok, *sret = NULL;
+    unsigned int id;
+    char *s;
+
+    s = malloc(strlen(method) + strlen(params) + 64);
+    if (!s)
+        return 0;
+    id = stratum_track_request(sctx, NULL, method, timeout, cb, status_cb, arg);
+    if (!id) {
+        free(s);
+        return 0;
+    }
 
-    if (!strstr(sctx->sockbuf, "\n")) {
-        bool ret = true;
-        time_t rstart;
+    sprintf(s, "{\"method\": \"%s\", \"params\": %s, \"id\": %u}", method, params, id);
+    if (!stratum_send_line(sctx, s)) {
+        stratum_release_request(stratum_take_request(sctx, id));
+        id = 0;
+    }
+    free(s);
+    return id;
+}
 
-        time(&rstart);
-        if (!socket_full(sctx->sock, timeout_)) {
-            applog(LOG_ERR, "stratum_recv_line timed out");
-            goto out;
-        }
-        do {
-            char s[RBUFSIZE];
-            ssize_t n;
-
-            memset(s, 0, RBUFSIZE);
-            n = recv(sctx->sock, s, RECVSIZE, 0);
-            if (!n) {
-                ret = false;
-                break;
-            }
-            if (n < 0) {
-                if (!socket_blocks() || !socket_full(sctx->sock, timeout_ == 60 ? 1: timeout_ )) {
-                    ret = false;
-                    break;
-                }
-            } else
-                stratum_buffer_append(sctx, s);
-        } while (time(NULL) - rstart < timeout_ && !strstr(sctx->sockbuf, "\n"));
+/*
+ * Sends method(params) and returns its request id, 0 if it could not be
+ * queued (the callback is then never called).
+ */
+unsigned int stratum_send_request(struct stratum_ctx *sctx, const char *method,
+                                  const char *params, int timeout,
+                                  stratum_reply_cb cb, void *arg)
+{
+    return stratum_send(sctx, method, params, timeout, cb, NULL, arg);
+}
 
-        if (!ret) {
-            applog(LOG_ERR, "stratum_recv_line failed");
-            goto out;
-        }
+/*
+ * Like stratum_send_request() for "submit", but the share waits up to
+ * opt_submit_window ms for others so that shares found close together by
+ * different GPUs leave in a single write. The event loop sends the batch
+ * when the window closes or the batch is full. With a caller-provided req
+ * nothing is allocated on the way to the socket.
+ */
+unsigned int stratum_submit(struct stratum_ctx *sctx, struct stratum_request *req,
+                            const char *params, int timeout,
+                            stratum_status_cb cb, void *arg)
+{
+    char line[SUBMIT_LINE_MAX];
+    bool queued = false, kick = false;
+    unsigned int id;
+    int len;
+
+    id = stratum_track_request(sctx, req, "submit", timeout, NULL, cb, arg);
+    if (!id)
+        return 0;
+    len = snprintf(line, sizeof(line), "{\"method\": \"submit\", \"params\": %s, \"id\": %u}", params, id);
+    if (len < 0 || len + 1 >= (int) sizeof(line)) {
+        applog(LOG_ERR, "stratum submit line too long");
+        goto err_out;
     }
 
-    buflen = strlen(sctx->sockbuf);
-    tok = strtok(sctx->sockbuf, "\n");
-    if (!tok) {
-        applog(LOG_ERR, "stratum_recv_line failed to parse a newline-terminated string");
-        goto out;
+    if (opt_submit_window <= 0) {
+        if (stratum_send_line(sctx, line))
+            return id;
+        goto err_out;
     }
-    sret = strdup(tok);
-    len = strlen(sret);
 
-    if (buflen > len + 1)
-        memmove(sctx->sockbuf, sctx->sockbuf + len + 1, buflen - len + 1);
-    else
-        sctx->sockbuf[0] = '\0';
+    if (opt_protocol)
+        applog(LOG_DEBUG, "> %s", line);
+    line[len++] = '\n';
 
-out:
-    if (sret && opt_protocol)
-    {
-        if(len > 2000)
-        {
-            char croppedres[1000] = {0};
-            strncpy(croppedres, sret, 997);
-            croppedres[996] = croppedres[997] = croppedres[998] = '.';
-            applog(LOG_DEBUG, "< %s", croppedres);
-        }else
-        {
-            applog(LOG_DEBUG, "< %s", sret);
+    pthread_mutex_lock(&sctx->sock_lock);
+    if (sctx->curl) {
+        if (!sctx->subq_n)
+            gettimeofday(&sctx->subq_first, NULL);
+        memcpy(sctx->subq[sctx->subq_n], line, len);
+        sctx->subq_len[sctx->subq_n++] = len;
+        queued = true;
+        kick = sctx->subq_n == 1;
+        if (sctx->subq_n == SUBMIT_BATCH_MAX) {
+            stratum_flush_submits(sctx);
+            kick = sctx->wbuf_len > 0;
         }
-
     }
-    return sret;
+    pthread_mutex_unlock(&sctx->sock_lock);
+
+    if (!queued)
+        goto err_out;
+    /* let the event loop pick up the window deadline */
+    if (kick)
+        stratum_evloop_kick(sctx);
+    return id;
+
+err_out:
+    stratum_release_request(stratum_take_request(sctx, id));
+    return 0;
 }
 
-char *stratum_recv_line(struct stratum_ctx *sctx)
+static void stratum_record_rtt(struct stratum_ctx *sctx, const struct stratum_request *req)
 {
-    return stratum_recv_line_timeout(sctx, 60);
+    if (!strcmp(req->method, "submit"))
+        hist_record_since(&sctx->lat_submit, &req->sent);
+    else if (!strcmp(req->method, "getjob"))
+        hist_record_since(&sctx->lat_getjob, &req->sent);
+    else if (!strcmp(req->method, "login"))
+        hist_record_since(&sctx->lat_login, &req->sent);
 }
 
-
-#if LIBCURL_VERSION_NUM >= 0x071101
-static curl_socket_t opensocket_grab_cb(void *clientp, curlsocktype purpose,
-struct curl_sockaddr *addr)
+/* hands a reply to the request it answers; false if no such request */
+bool stratum_dispatch_response(struct stratum_ctx *sctx, json_t *val)
 {
-    curl_socket_t *sock = clientp;
-    *sock = socket(addr->family, addr->socktype, addr->protocol);
-    return *sock;
+    json_t *id_val = json_object_get(val, "id");
+    struct stratum_request *req;
+
+    if (!id_val || !json_is_integer(id_val))
+        return false;
+    req = stratum_take_request(sctx, (unsigned int) json_integer_value(id_val));
+    if (!req)
+        return false;
+    stratum_record_rtt(sctx, req);
+    stratum_complete_request(sctx, req, val, NULL);
+    return true;
 }
-#endif
 
-bool stratum_connect(struct stratum_ctx *sctx, const char *url)
+/*
+ * Hands a fast-decoded status reply to its request, if that request only
+ * wants a status. False leaves it in the table for the JSON path.
+ */
+static bool stratum_dispatch_status(struct stratum_ctx *sctx, unsigned int id,
+                                    const struct stratum_status *st)
 {
-    CURL *curl;
-    int rc;
+    struct stratum_request **pp, *req = NULL;
+
+    pthread_mutex_lock(&sctx->req_lock);
+    for (pp = &sctx->inflight; *pp; pp = &(*pp)->next) {
+        if ((*pp)->id == id) {
+            if ((*pp)->status_cb) {
+                req = *pp;
+                *pp = req->next;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sctx->req_lock);
 
-    pthread_mutex_lock(&sctx->sock_lock);
-    if (sctx->curl)
-        curl_easy_cleanup(sctx->curl);
-    sctx->curl = curl_easy_init();
-    if (!sctx->curl) {
-        applog(LOG_ERR, "CURL initialization failed");
-        pthread_mutex_unlock(&sctx->sock_lock);
+    if (!req)
         return false;
-    }
-    curl = sctx->curl;
-    if (!sctx->sockbuf) {
-        sctx->sockbuf = calloc(RBUFSIZE, 1);
-        sctx->sockbuf_size = RBUFSIZE;
-    }
-    sctx->sockbuf[0] = '\0';
-    pthread_mutex_unlock(&sctx->sock_lock);
+    stratum_record_rtt(sctx, req);
+    stratum_complete_request(sctx, req, NULL, st);
+    return true;
+}
 
-    if (url != sctx->url) {
-        free(sctx->url);
-        sctx->url = strdup(url);
+/* fails requests whose deadline passed, or all of them if all is set */
+static void stratum_drop_requests(struct stratum_ctx *sctx, time_t now, bool all)
+{
+    struct stratum_request **pp, *req, *dead = NULL;
+
+    pthread_mutex_lock(&sctx->req_lock);
+    pp = &sctx->inflight;
+    while ((req = *pp)) {
+        if (all || now >= req->deadline) {
+            *pp = req->next;
+            req->next = dead;
+            dead = req;
+        } else
+            pp = &req->next;
     }
-    free(sctx->curl_url);
-    sctx->curl_url = malloc(strlen(url));
-    sprintf(sctx->curl_url, "http%s", strstr(url, "://"));
+    pthread_mutex_unlock(&sctx->req_lock);
 
-    if (opt_protocol)
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-    curl_easy_setopt(curl, CURLOPT_URL, sctx->curl_url);
-    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, sctx->curl_err_str);
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
-    if (opt_proxy) {
-        curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy);
-        curl_easy_setopt(curl, CURLOPT_PROXYTYPE, opt_proxy_type);
-    }
-    curl_easy_setopt(curl, CURLOPT_HTTPPROXYTUNNEL, 1);
-#if LIBCURL_VERSION_NUM >= 0x070f06
-    curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_keepalive_cb);
-#endif
-#if LIBCURL_VERSION_NUM >= 0x071101
-    curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, opensocket_grab_cb);
-    curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, &sctx->sock);
-#endif
-    curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1);
+    while ((req = dead)) {
+        static const struct stratum_status lost = { NULL, NULL, true };
 
-    rc = curl_easy_perform(curl);
-    if (rc) {
-        applog(LOG_ERR, "Stratum connection failed: %s", sctx->curl_err_str);
-        curl_easy_cleanup(curl);
-        sctx->curl = NULL;
-        return false;
+        dead = req->next;
+        if (!all)
+            applog(LOG_ERR, "Stratum %s request %u timed out", req->method, req->id);
+        stratum_complete_request(sctx, req, NULL, all ? &lost : NULL);
     }
+}
 
-#if LIBCURL_VERSION_NUM < 0x071101
-    /* CURLINFO_LASTSOCKET is broken on Win64; only use it as a last resort */
-    curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, (long *)&sctx->sock);
-#endif
+void stratum_expire_requests(struct stratum_ctx *sctx, time_t now)
+{
+    stratum_drop_requests(sctx, now, false);
+}
 
-    return true;
+/* earliest request deadline, 0 if nothing is in flight */
+time_t stratum_requests_deadline(struct stratum_ctx *sctx)
+{
+    struct stratum_request *req;
+    time_t next = 0;
+
+    pthread_mutex_lock(&sctx->req_lock);
+    for (req = sctx->inflight; req; req = req->next) {
+        if (!next || req->deadline < next)
+            next = req->deadline;
+    }
+    pthread_mutex_unlock(&sctx->req_lock);
+    return next;
 }
 
-void stratum_disconnect(struct stratum_ctx *sctx)
+/*
+ * The stratum event loop. Waits up to timeout_ms for the socket to become
+ * readable while flushing the write queue whenever the socket can take
+ * more. Returns 1 when there is data to read, 0 on timeout and -1 if the
+ * connection failed.
+ */
+int stratum_poll(struct stratum_ctx *sctx, int timeout_ms)
+{
+    struct timeval tv_start, tv_now, diff;
+    int elapsed = 0;
+
+    gettimeofday(&tv_start, NULL);
+    for (;;) {
+        int left = timeout_ms - elapsed, n;
+        bool readable = false, want_out;
+
+        if (left < 0)
+            left = 0;
+
+        pthread_mutex_lock(&sctx->sock_lock);
+        if (!sctx->curl || !stratum_flush(sctx)) {
+            pthread_mutex_unlock(&sctx->sock_lock);
+            return -1;
+        }
+        if (sctx->subq_n) {
+            /* wake up when the submit window closes */
+            gettimeofday(&tv_now, NULL);
+            timeval_subtract(&diff, &tv_now, &sctx->subq_first);
+            n = opt_submit_window - (int) (diff.tv_sec * 1000 + diff.tv_usec / 1000);
+            if (n <= 0 && !stratum_flush_submits(sctx)) {
+                pthread_mutex_unlock(&sctx->sock_lock);
+                return -1;
+            }
+            if (n > 0 && n < left)
+                left = n;
+        }
+        want_out = sctx->wbuf_len > 0;
+        pthread_mutex_unlock(&sctx->sock_lock);
+
+#ifdef __linux
+        struct epoll_event evs[2];
+
+        if (want_out != sctx->want_out) {
+            struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.fd = sctx->sock };
+            epoll_ctl(sctx->epfd, EPOLL_CTL_MOD, sctx->sock, &ev);
+            sctx->want_out = want_out;
+        }
+        n = epoll_wait(sctx->epfd, evs, 2, left);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        while (n-- > 0) {
+            if (evs[n].data.fd == sctx->wakefd[0])
+                stratum_evloop_drain(sctx);
+            else if (evs[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                readable = true;
+        }
+#else
+        struct timeval tv = { left / 1000, (left % 1000) * 1000 };
+        fd_set rd, wr;
+        int maxfd = sctx->sock;
+
+        FD_ZERO(&rd);
+        FD_ZERO(&wr);
+        FD_SET(sctx->sock, &rd);
+        if (want_out)
+            FD_SET(sctx->sock, &wr);
+        if (sctx->wakefd[0] >= 0) {
+            FD_SET(sctx->wakefd[0], &rd);
+            if (sctx->wakefd[0] > maxfd)
+                maxfd = sctx->wakefd[0];
+        }
+        n = select(maxfd + 1, &rd, &wr, NULL, &tv);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0) {
+            if (sctx->wakefd[0] >= 0 && FD_ISSET(sctx->wakefd[0], &rd))
+                stratum_evloop_drain(sctx);
+            readable = FD_ISSET(sctx->sock, &rd);
+        }
+#endif
+        if (readable)
+            return 1;
+        if (sctx->interrupted) {
+            sctx->interrupted = false;
+            return 0;
+        }
+
+        gettimeofday(&tv_now, NULL);
+        timeval_subtract(&diff, &tv_now, &tv_start);
+        elapsed = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+        if (elapsed >= timeout_ms)
+            return 0;
+    }
+}
+
+/* makes a stratum_poll() in progress return early, as if it timed out */
+void stratum_interrupt(struct stratum_ctx *sctx)
+{
+    sctx->interrupted = true;
+    stratum_evloop_kick(sctx);
+}
+
+bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
+{
+    return stratum_wait(sctx, timeout * 1000) > 0;
+}
+
+/* stratum_poll() that also counts already buffered input as readable */
+int stratum_wait(struct stratum_ctx *sctx, int timeout_ms)
+{
+    if (sctx->sockbuf_len > sctx->sockbuf_start)
+        return 1;
+    return stratum_poll(sctx, timeout_ms);
+}
+
+/*
+ * Receive buffer layout: [0, start) already handed out, [start, len) pending,
+ * [start, scan) known to contain no newline. Data is received in place at the
+ * tail and consumed lines are only dropped when room is needed, so framing a
+ * line costs O(line length) however many recv() calls it spans.
+ */
+static bool stratum_buffer_reserve(struct stratum_ctx *sctx)
+{
+    size_t pending = sctx->sockbuf_len - sctx->sockbuf_start;
+
+    if (sctx->sockbuf_start) {
+        memmove(sctx->sockbuf, sctx->sockbuf + sctx->sockbuf_start, pending);
+        sctx->sockbuf_scan -= sctx->sockbuf_start;
+        sctx->sockbuf_len = pending;
+        sctx->sockbuf_start = 0;
+    }
+    if (sctx->sockbuf_size - sctx->sockbuf_len < RECVSIZE_MIN + 1) {
+        size_t sz = sctx->sockbuf_size * 2;
+        char *p;
+
+        while (sz - sctx->sockbuf_len < RECVSIZE_MIN + 1)
+            sz *= 2;
+        p = realloc(sctx->sockbuf, sz);
+        if (!p) {
+            applog(LOG_ERR, "stratum receive buffer: failed to grow to %lu bytes",
+                   (unsigned long) sz);
+            return false;
+        }
+        sctx->sockbuf = p;
+        sctx->sockbuf_size = sz;
+    }
+    return true;
+}
+
+/* frame the next complete line, NULL if none is buffered yet */
+static char *stratum_buffer_line(struct stratum_ctx *sctx)
+{
+    char *line, *nl;
+
+    do {
+        line = sctx->sockbuf + sctx->sockbuf_start;
+        nl = memchr(sctx->sockbuf + sctx->sockbuf_scan, '\n',
+                    sctx->sockbuf_len - sctx->sockbuf_scan);
+        if (!nl) {
+            sctx->sockbuf_scan = sctx->sockbuf_len;
+            return NULL;
+        }
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r')
+            nl[-1] = '\0';
+        sctx->sockbuf_start = sctx->sockbuf_scan = nl + 1 - sctx->sockbuf;
+    } while (!*line);	/* skip blank lines */
+
+    return line;
+}
+
+/*
+ * Returns a view into the receive buffer, valid until the next receive on
+ * this context. Callers must not free() it.
+ */
+char *stratum_recv_line_timeout(struct stratum_ctx *sctx, int timeout_)
+{
+    size_t len = 0;
+    char *sret;
+    time_t rstart;
+    bool kicked = false;
+
+    time(&rstart);
+    while (!(sret = stratum_buffer_line(sctx))) {
+        ssize_t n;
+        int left = timeout_ - (time(NULL) - rstart), rc;
+
+        if (!stratum_buffer_reserve(sctx))
+            break;
+        rc = stratum_poll(sctx, (left > 0 ? left : 0) * 1000);
+        if (!rc && left > 0) {
+            /* a poll that ran its full time is a timeout, not a kick */
+            kicked |= time(NULL) - rstart < timeout_;
+            continue;	/* interrupted, keep assembling the line */
+        }
+        if (rc <= 0) {
+            if (!rc)
+                applog(LOG_ERR, "stratum_recv_line timed out");
+            break;
+        }
+        n = recv(sctx->sock, sctx->sockbuf + sctx->sockbuf_len,
+                 sctx->sockbuf_size - sctx->sockbuf_len - 1, 0);
+        if (!n)
+            break;
+        if (n < 0) {
+            if (!socket_blocks() && errno != EINTR)
+                break;
+            continue;
+        }
+        sctx->sockbuf_len += n;
+    }
+    /* the poll consumed the interrupt: raise it again for the caller */
+    if (kicked)
+        stratum_interrupt(sctx);
+
+    if (!sret) {
+        applog(LOG_ERR, "stratum_recv_line failed");
+        return NULL;
+    }
+    gettimeofday(&sctx->line_rx, NULL);
+
+    if (opt_protocol)
+    {
+        len = strlen(sret);
+        if(len > 2000)
+        {
+            char croppedres[1000] = {0};
+            strncpy(croppedres, sret, 997);
+            croppedres[996] = croppedres[997] = croppedres[998] = '.';
+            applog(LOG_DEBUG, "< %s", croppedres);
+        }else
+        {
+            applog(LOG_DEBUG, "< %s", sret);
+        }
+
+    }
+    return sret;
+}
+
+char *stratum_recv_line(struct stratum_ctx *sctx)
+{
+    return stratum_recv_line_timeout(sctx, 60);
+}
+
+
+#if LIBCURL_VERSION_NUM >= 0x071101
+static curl_socket_t opensocket_grab_cb(void *clientp, curlsocktype purpose,
+struct curl_sockaddr *addr)
+{
+    curl_socket_t *sock = clientp;
+    *sock = socket(addr->family, addr->socktype, addr->protocol);
+    return *sock;
+}
+#endif
+
+bool stratum_connect(struct stratum_ctx *sctx, const char *url)
+{
+    CURL *curl;
+    int rc;
+
+    pthread_mutex_lock(&sctx->sock_lock);
+    if (sctx->curl)
+        curl_easy_cleanup(sctx->curl);
+    sctx->curl = curl_easy_init();
+    if (!sctx->curl) {
+        applog(LOG_ERR, "CURL initialization failed");
+        pthread_mutex_unlock(&sctx->sock_lock);
+        return false;
+    }
+    curl = sctx->curl;
+    if (!sctx->sockbuf) {
+        sctx->sockbuf = calloc(RECVSIZE_MIN * 2, 1);
+        sctx->sockbuf_size = RECVSIZE_MIN * 2;
+    }
+    sctx->sockbuf_start = sctx->sockbuf_scan = sctx->sockbuf_len = 0;
+    pthread_mutex_unlock(&sctx->sock_lock);
+
+    if (url != sctx->url) {
+        free(sctx->url);
+        sctx->url = strdup(url);
+    }
+    free(sctx->curl_url);
+    sctx->curl_url = malloc(strlen(url));
+    sprintf(sctx->curl_url, "http%s", strstr(url, "://"));
+
+    if (opt_protocol)
+        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+    curl_easy_setopt(curl, CURLOPT_URL, sctx->curl_url);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, sctx->curl_err_str);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
+    if (opt_proxy) {
+        curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy);
+        curl_easy_setopt(curl, CURLOPT_PROXYTYPE, opt_proxy_type);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPPROXYTUNNEL, 1);
+#if LIBCURL_VERSION_NUM >= 0x070f06
+    curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_keepalive_cb);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071101
+    curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, opensocket_grab_cb);
+    curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, &sctx->sock);
+#endif
+    curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1);
+
+    rc = curl_easy_perform(curl);
+    if (rc) {
+        applog(LOG_ERR, "Stratum connection failed: %s", sctx->curl_err_str);
+        curl_easy_cleanup(curl);
+        sctx->curl = NULL;
+        return false;
+    }
+
+#if LIBCURL_VERSION_NUM < 0x071101
+    /* CURLINFO_LASTSOCKET is broken on Win64; only use it as a last resort */
+    curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, (long *)&sctx->sock);
+#endif
+
+    stratum_evloop_init(sctx);
+#ifndef WIN32
+    fcntl(sctx->sock, F_SETFL, fcntl(sctx->sock, F_GETFL) | O_NONBLOCK);
+#endif
+#ifdef __linux
+    {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = sctx->sock };
+        epoll_ctl(sctx->epfd, EPOLL_CTL_ADD, sctx->sock, &ev);
+        sctx->want_out = false;
+    }
+#endif
+
+    return true;
+}
+
+void stratum_disconnect(struct stratum_ctx *sctx)
 {
     pthread_mutex_lock(&sctx->sock_lock);
     if (sctx->curl) {
+#ifdef __linux
+        epoll_ctl(sctx->epfd, EPOLL_CTL_DEL, sctx->sock, NULL);
+#endif
         curl_easy_cleanup(sctx->curl);
         sctx->curl = NULL;
-        sctx->sockbuf[0] = '\0';
+        sctx->sockbuf_start = sctx->sockbuf_scan = sctx->sockbuf_len = 0;
+        sctx->wbuf_len = 0;
     }
+    sctx->subq_n = 0;
     pthread_mutex_unlock(&sctx->sock_lock);
+
+    /* replies to anything still in flight will never arrive */
+    stratum_drop_requests(sctx, 0, true);
 }
 
 static const char *get_stratum_session_id(json_t *val)
@@ -871,41 +1603,72 @@ static const char *get_stratum_session_id(json_t *val)
 
 bool stratum_subscribe(struct stratum_ctx *sctx) { return(true); }
 
-bool stratum_getscratchpad(struct stratum_ctx *sctx) {
+struct stratum_call_slot {
+    bool done;
+    json_t *val;
+};
 
-    json_t *val = NULL, *res_val, *err_val;
-    char *s, *sret;
-    json_error_t err;
-    //bool ret = false;
+static void stratum_call_done(struct stratum_ctx *sctx, json_t *val, void *arg)
+{
+    struct stratum_call_slot *slot = arg;
 
-    s = malloc(1000);
-    sprintf(s, "{\"method\": \"getfullscratchpad\", \"params\": {\"id\": \"%s\", \"agent\": \"cpuminer-multi/0.1\"}, \"id\": 1}", rpc2_id);
+    slot->done = true;
+    slot->val = val ? json_incref(val) : NULL;
+}
 
-    applog(LOG_INFO, "Getting full scratchpad....");
-    if (!stratum_send_line(sctx, s))
-        goto out;
+/*
+ * Synchronous request: keeps servicing the connection (notifications,
+ * replies to other in-flight requests) until this request's own reply
+ * arrives. Returns the reply, or NULL on timeout/failure.
+ */
+static json_t *stratum_call(struct stratum_ctx *sctx, const char *method,
+                            const char *params, int timeout)
+{
+    struct stratum_call_slot slot = { false, NULL };
+    time_t deadline = time(NULL) + timeout;
+    unsigned int id;
 
-    sret = stratum_recv_line_timeout(sctx, 920);
-    if (!sret)
-        goto out;
-    applog(LOG_DEBUG, "Getting full scratchpad received line");
+    id = stratum_send_request(sctx, method, params, timeout, stratum_call_done, &slot);
+    if (!id)
+        return NULL;
 
-    val = JSON_LOADS(sret, &err);
-    free(sret);
-    if (!val) {
-        applog(LOG_ERR, "JSON decode rpc2_getscratchpad response failed(%d): %s", err.line, err.text);
-        goto out;
+    while (!slot.done) {
+        int left = deadline - time(NULL);
+        char *line;
+
+        if (left <= 0) {
+            applog(LOG_ERR, "Stratum %s request %u timed out", method, id);
+            break;
+        }
+        line = stratum_recv_line_timeout(sctx, left);
+        if (!line)
+            break;
+        stratum_handle_line(sctx, line);
     }
 
-    applog(LOG_DEBUG, "Getting full scratchpad parsed line");
+    /* never leave a pointer to this stack frame behind */
+    if (!slot.done)
+        stratum_release_request(stratum_take_request(sctx, id));
+    return slot.val;
+}
 
-    bool ret = rpc2_getfullscratchpad_decode(val);  
+bool stratum_getscratchpad(struct stratum_ctx *sctx) {
 
+    json_t *val;
+    char s[1000];
+    bool ret;
 
-out:
-    free(s);
-    if (val)
-        json_decref(val);
+    sprintf(s, "{\"id\": \"%s\", \"agent\": \"cpuminer-multi/0.1\"}", rpc2_id);
+
+    applog(LOG_INFO, "Getting full scratchpad....");
+    val = stratum_call(sctx, "getfullscratchpad", s, 920);
+    if (!val)
+        return false;
+
+    applog(LOG_DEBUG, "Getting full scratchpad parsed line");
+
+    ret = rpc2_getfullscratchpad_decode(val);
+    json_decref(val);
 
     return ret;
 }
@@ -913,14 +1676,12 @@ out:
 bool stratum_request_job(struct stratum_ctx *sctx)
 {
     json_t *val = NULL, *res_val, *err_val;
-    char *sret;
     char s[20000] = {0};
-    json_error_t err;
     bool ret = false;
 
     if(jsonrpc_2) 
     {
-        sprintf(s, "{\"method\": \"getjob\", \"params\": {\"id\": \"%s\", \"hi\": { \"height\": %" PRIu64 ", \"block_id\": \"%s\" }, \"agent\": \"cpuminer-multi/0.1\"}, \"id\": 1}",
+        sprintf(s, "{\"id\": \"%s\", \"hi\": { \"height\": %" PRIu64 ", \"block_id\": \"%s\" }, \"agent\": \"cpuminer-multi/0.1\"}",
             rpc2_id, current_scratchpad_hi.height, bin2hex((const unsigned char*)current_scratchpad_hi.prevhash, 32));
 
     }else
@@ -928,23 +1689,10 @@ bool stratum_request_job(struct stratum_ctx *sctx)
         return false;
     }
 
-    if(!stratum_send_line(sctx, s))
+    val = stratum_call(sctx, "getjob", s, 60);
+    if (!val)
     {
-        applog(LOG_ERR, "Stratum failed to send getjob line");
-        goto out;
-    }
-
-    sret = stratum_recv_line(sctx);
-    if (!sret)
-    {
-        applog(LOG_ERR, "Stratum failed to recv getjob line");
-        goto out;
-    }
-
-    val = JSON_LOADS(sret, &err);
-    free(sret);
-    if (!val) {
-        applog(LOG_ERR, "JSON getwork decode failed(%d): %s", err.line, err.text);
+        applog(LOG_ERR, "Stratum failed to get getjob reply");
         goto out;
     }
 
@@ -968,65 +1716,42 @@ out:
 
     return ret;
 }
-bool stratum_keepalived(struct stratum_ctx *sctx, const char *rpc2_id) {
 
+static void stratum_keepalived_reply(struct stratum_ctx *sctx, const struct stratum_status *st, void *arg)
+{
+    if (st && st->status && !strcmp(st->status, "KEEPALIVED") && !sctx->standby)
+        applog(LOG_INFO, "Keepalive received");
+}
 
-        json_t *val = NULL, *res_val, *err_val;
-        char *s, *sret;
-        json_error_t err;
-        bool ret = false;
+bool stratum_keepalived(struct stratum_ctx *sctx, const char *rpc2_id) {
 
-    if(jsonrpc_2) {
-         s = malloc(300 + strlen(rpc2_id));
-         snprintf(s, 128, "{\"method\": \"keepalived\", \"params\": {\"id\": \"%s\"}, \"id\":1}\r\n", rpc2_id);
-    } else {
-            return true ;
+    char s[300];
 
-        }
-        if (!stratum_send_line(sctx, s))
-                goto out;
-        ret = true;
-out:
-        free(s);
-        return ret;
+    if(!jsonrpc_2)
+        return true;
+
+    snprintf(s, sizeof(s), "{\"id\": \"%s\"}", rpc2_id);
+    return stratum_send(sctx, "keepalived", s, 60, NULL, stratum_keepalived_reply, NULL) != 0;
 }
 
 bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *pass)
 {
     json_t *val = NULL, *res_val, *err_val;
-    char *s, *sret;
-    json_error_t err;
+    char *s;
     bool ret = false;
 
+    s = malloc(300 + strlen(user) + strlen(pass));
     if(jsonrpc_2) {
-        s = malloc(300 + strlen(user) + strlen(pass));
-        sprintf(s, "{\"method\": \"login\", \"params\": {\"login\": \"%s\", \"pass\": \"%s\", \"hi\": { \"height\": %" PRIu64 ", \"block_id\": \"%s\" }, \"agent\": \"cpuminer-multi/0.1\"}, \"id\": 1}",
+        sprintf(s, "{\"login\": \"%s\", \"pass\": \"%s\", \"hi\": { \"height\": %" PRIu64 ", \"block_id\": \"%s\" }, \"agent\": \"cpuminer-multi/0.1\"}",
             user, pass, current_scratchpad_hi.height, bin2hex((const unsigned char*)current_scratchpad_hi.prevhash, 32));
+        val = stratum_call(sctx, "login", s, 60);
     } else {
-        s = malloc(80 + strlen(user) + strlen(pass));
-        sprintf(s, "{\"id\": 2, \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}",
-            user, pass);
+        sprintf(s, "[\"%s\", \"%s\"]", user, pass);
+        val = stratum_call(sctx, "mining.authorize", s, 60);
     }
-
-    if (!stratum_send_line(sctx, s))
+    if (!val)
         goto out;
 
-    while (1) {
-        sret = stratum_recv_line(sctx);
-        if (!sret)
-            goto out;
-        if (!stratum_handle_method(sctx, sret))
-            break;
-        free(sret);
-    }
-
-    val = JSON_LOADS(sret, &err);
-    free(sret);
-    if (!val) {
-        applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
-        goto out;
-    }
-
     res_val = json_object_get(val, "result");
     err_val = json_object_get(val, "error");
 
@@ -1036,7 +1761,16 @@ bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *p
             goto out;
     }
 
-    if(jsonrpc_2) {
+    if(jsonrpc_2 && sctx->standby) {
+        /* standby session: keep the id, leave the job to the active pool */
+        const char *id = json_string_value(json_object_get(res_val, "id"));
+        if (!id) {
+            applog(LOG_ERR, "Stratum login reply without session id");
+            goto out;
+        }
+        free(sctx->session_id);
+        sctx->session_id = strdup(id);
+    } else if(jsonrpc_2) {
         rpc2_login_decode(val);
         json_t *job_val = json_object_get(res_val, "job");
         pthread_mutex_lock(&sctx->work_lock);
@@ -1242,19 +1976,12 @@ static bool stratum_show_message(struct stratum_ctx *sctx, json_t *id, json_t *p
     return ret;
 }
 
-bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
+static bool stratum_handle_method_val(struct stratum_ctx *sctx, json_t *val)
 {
-    json_t *val, *id, *params;
-    json_error_t err;
+    json_t *id, *params;
     const char *method;
     bool ret = false;
 
-    val = JSON_LOADS(s, &err);
-    if (!val) {
-        applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
-        goto out;
-    }
-
     method = json_string_value(json_object_get(val, "method"));
     if (!method)
         goto out;
@@ -1262,6 +1989,13 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
     params = json_object_get(val, "params");
 
     if (jsonrpc_2) {
+        if (!strcasecmp(method, "job") && sctx->standby) {
+            /* the scratchpad follows the active pool only */
+            if (opt_debug)
+                applog(LOG_DEBUG, "standby pool %s: new job", sctx->url);
+            ret = true;
+            goto out;
+        }
         if (!strcasecmp(method, "job")) {
             ret = stratum_2_job(sctx, params);
             goto out;
@@ -1290,54 +2024,396 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
     }
 
 out:
-    if (val)
-        json_decref(val);
+    return ret;
+}
+
+bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
+{
+    json_t *val;
+    json_error_t err;
+    bool ret;
+
+    val = JSON_LOADS(s, &err);
+    if (!val) {
+        applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
+        return false;
+    }
+    ret = stratum_handle_method_val(sctx, val);
+    json_decref(val);
+    return ret;
+}
+
+/*
+ * Single-pass decoder for the messages that make up nearly all traffic:
+ * pushed jobs without addendums and status-only replies (submit,
+ * keepalived). Fields go straight into fixed-size storage; anything it
+ * does not fully understand (escapes, arrays, deeper nesting, other
+ * methods) is left to jansson.
+ */
+enum fast_scope { FAST_TOP, FAST_PARAMS, FAST_RESULT, FAST_ERROR };
+
+struct fast_msg {
+    bool has_id, has_method, has_result, has_error;
+    unsigned int id;
+    int job_fields;			/* FAST_JOB_* bits seen */
+    char status[32];
+    char message[128];
+    struct rpc2_job job;
+};
+
+#define FAST_JOB_BLOB	1
+#define FAST_JOB_ID	2
+#define FAST_JOB_TARGET	4
+
+static const char *fast_ws(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+
+/* a string without escapes; *len excludes the quotes */
+static const char *fast_string(const char *p, const char **str, size_t *len)
+{
+    const char *q;
+
+    if (*p != '"')
+        return NULL;
+    for (q = ++p; *q != '"'; q++) {
+        if (!*q || *q == '\\')
+            return NULL;
+    }
+    *str = p;
+    *len = q - p;
+    return q + 1;
+}
+
+static bool fast_hex(unsigned char *out, const char *hex, size_t bytes)
+{
+    size_t i;
+
+    for (i = 0; i < bytes * 2; i++) {
+        int c = hex[i], v;
+
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v = c - 'A' + 10;
+        else
+            return false;
+        if (i & 1)
+            out[i / 2] |= v;
+        else
+            out[i / 2] = v << 4;
+    }
+    return true;
+}
+
+static bool fast_copy(char *dst, size_t size, const char *str, size_t len)
+{
+    if (len >= size)
+        return false;
+    memcpy(dst, str, len);
+    dst[len] = '\0';
+    return true;
+}
+
+#define FAST_KEY(k) (klen == sizeof(k) - 1 && !memcmp(key, k, klen))
+
+static const char *fast_object(const char *p, enum fast_scope scope, struct fast_msg *m)
+{
+    p = fast_ws(p);
+    if (*p != '{')
+        return NULL;
+    p = fast_ws(p + 1);
+    if (*p == '}')
+        return p + 1;
+
+    for (;;) {
+        const char *key, *str = NULL;
+        size_t klen, len = 0;
+        bool null = false, nested = false;
+        char *end;
+
+        if (!(p = fast_string(p, &key, &klen)))
+            return NULL;
+        p = fast_ws(p);
+        if (*p++ != ':')
+            return NULL;
+        p = fast_ws(p);
+
+        if (*p == '{') {
+            nested = true;
+            if (scope == FAST_TOP && FAST_KEY("params") && m->has_method)
+                p = fast_object(p, FAST_PARAMS, m);
+            else if (scope == FAST_TOP && FAST_KEY("result")) {
+                m->has_result = true;
+                p = fast_object(p, FAST_RESULT, m);
+            } else if (scope == FAST_TOP && FAST_KEY("error")) {
+                m->has_error = true;
+                strcpy(m->message, "unknown");
+                p = fast_object(p, FAST_ERROR, m);
+            } else
+                return NULL;
+            if (!p)
+                return NULL;
+        } else if (*p == '[') {
+            nested = true;
+            /* only an empty addendum list is simple enough */
+            if (scope != FAST_PARAMS || !FAST_KEY("addms"))
+                return NULL;
+            p = fast_ws(p + 1);
+            if (*p++ != ']')
+                return NULL;
+        } else if (*p == '"') {
+            if (!(p = fast_string(p, &str, &len)))
+                return NULL;
+        } else if (!strncmp(p, "null", 4)) {
+            null = true;
+            p += 4;
+        } else if (!strncmp(p, "true", 4)) {
+            p += 4;
+        } else if (!strncmp(p, "false", 5)) {
+            p += 5;
+        } else {
+            unsigned long v = strtoul(p, &end, 10);
+
+            if (end == p)
+                return NULL;
+            if (scope == FAST_TOP && FAST_KEY("id")) {
+                m->has_id = true;
+                m->id = v;
+            }
+            p = end;
+            /* fractions and exponents are nothing we look at */
+            while (*p == '.' || *p == 'e' || *p == 'E' || *p == '-' || *p == '+' || isdigit((unsigned char) *p))
+                p++;
+        }
+
+        if (str) {
+            switch (scope) {
+            case FAST_TOP:
+                if (FAST_KEY("method")) {
+                    if (len != 3 || memcmp(str, "job", 3))
+                        return NULL;
+                    m->has_method = true;
+                } else if (FAST_KEY("id"))
+                    return NULL;	/* not one of our numeric ids */
+                else if (FAST_KEY("result"))
+                    m->has_result = true;
+                else if (FAST_KEY("error")) {
+                    /* the reason as a bare string, no error object */
+                    m->has_error = true;
+                    if (!fast_copy(m->message, sizeof(m->message), str, len))
+                        return NULL;
+                }
+                break;
+            case FAST_PARAMS:
+                if (FAST_KEY("blob")) {
+                    if (len % 2 || len / 2 < 40 || len / 2 > sizeof(m->job.blob)
+                        || !fast_hex(m->job.blob, str, len / 2))
+                        return NULL;
+                    m->job.bloblen = len / 2;
+                    m->job_fields |= FAST_JOB_BLOB;
+                } else if (FAST_KEY("job_id")) {
+                    if (!fast_copy(m->job.job_id, sizeof(m->job.job_id), str, len))
+                        return NULL;
+                    m->job_fields |= FAST_JOB_ID;
+                } else if (FAST_KEY("target")) {
+                    if (len != 8 || !fast_hex((unsigned char *) &m->job.target, str, 4))
+                        return NULL;
+                    m->job_fields |= FAST_JOB_TARGET;
+                }
+                break;
+            case FAST_RESULT:
+                if (FAST_KEY("status") && !fast_copy(m->status, sizeof(m->status), str, len))
+                    return NULL;
+                break;
+            case FAST_ERROR:
+                if (FAST_KEY("message") && !fast_copy(m->message, sizeof(m->message), str, len))
+                    return NULL;
+                break;
+            }
+        } else if (nested)
+            ;
+        else if (scope == FAST_TOP && FAST_KEY("result"))
+            m->has_result = true;
+        else if (scope == FAST_TOP && FAST_KEY("error") && !null) {
+            m->has_error = true;
+            strcpy(m->message, "unknown");
+        }
+
+        p = fast_ws(p);
+        if (*p == '}')
+            return p + 1;
+        if (*p++ != ',')
+            return NULL;
+        p = fast_ws(p);
+    }
+}
+
+/* true if the line was fully handled here */
+static bool stratum_handle_fast(struct stratum_ctx *sctx, const char *s)
+{
+    struct fast_msg m;
+    const char *p;
+    bool ret;
+
+    memset(&m, 0, sizeof(m));
+    p = fast_object(s, FAST_TOP, &m);
+    if (!p || *fast_ws(p))
+        return false;
+
+    if (m.has_method) {
+        if (!jsonrpc_2 || m.job_fields != (FAST_JOB_BLOB | FAST_JOB_ID | FAST_JOB_TARGET))
+            return false;
+        sctx->fast_lines++;
+        if (sctx->standby) {
+            /* the scratchpad follows the active pool only */
+            if (opt_debug)
+                applog(LOG_DEBUG, "standby pool %s: new job", sctx->url);
+            return true;
+        }
+        pthread_mutex_lock(&sctx->work_lock);
+        ret = rpc2_job_apply(&m.job, &sctx->work);
+        pthread_mutex_unlock(&sctx->work_lock);
+        if (!ret)
+            applog(LOG_ERR, "Stratum job apply failed");
+        return true;
+    }
+
+    if (m.has_id && (m.has_result || m.has_error)) {
+        struct stratum_status st = {
+            m.status[0] ? m.status : NULL,
+            m.has_error ? m.message : NULL,
+        };
+        if (!stratum_dispatch_status(sctx, m.id, &st))
+            return false;
+        sctx->fast_lines++;
+        return true;
+    }
+    return false;
+}
 
+/* one received line: a server notification/request or a reply to ours */
+bool stratum_handle_line(struct stratum_ctx *sctx, const char *s)
+{
+    json_t *val, *id;
+    json_error_t err;
+    bool ret = true;
+
+    if (stratum_handle_fast(sctx, s))
+        return true;
+
+    sctx->json_lines++;
+    val = JSON_LOADS(s, &err);
+    if (!val) {
+        applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
+        return false;
+    }
+    if (json_object_get(val, "method"))
+        ret = stratum_handle_method_val(sctx, val);
+    else if (!stratum_dispatch_response(sctx, val)) {
+        id = json_object_get(val, "id");
+        if (id && !json_is_null(id))
+            applog(LOG_DEBUG, "Stratum reply to unknown request id %lld",
+                   (long long) json_integer_value(id));
+    }
+    json_decref(val);
     return ret;
 }
 
 struct thread_q *tq_new(void)
 {
     struct thread_q *tq;
+    unsigned long i;
 
     tq = calloc(1, sizeof(*tq));
     if (!tq)
         return NULL;
-
-    INIT_LIST_HEAD(&tq->q);
+    tq->cells = calloc(TQ_SIZE, sizeof(*tq->cells));
+    if (!tq->cells) {
+        free(tq);
+        return NULL;
+    }
+    for (i = 0; i < TQ_SIZE; i++)
+        tq->cells[i].seq = i;
+    tq->mask = TQ_SIZE - 1;
+#ifndef __linux
     pthread_mutex_init(&tq->mutex, NULL);
     pthread_cond_init(&tq->cond, NULL);
+#endif
 
     return tq;
 }
 
 void tq_free(struct thread_q *tq)
 {
-    struct tq_ent *ent, *iter;
-
     if (!tq)
         return;
 
-    list_for_each_entry_safe(ent, iter, &tq->q, q_node) {
-        list_del(&ent->q_node);
-        free(ent);
-    }
-
+#ifndef __linux
     pthread_cond_destroy(&tq->cond);
     pthread_mutex_destroy(&tq->mutex);
-
+#endif
+    free(tq->cells);
     memset(tq, 0, sizeof(*tq));	/* poison */
     free(tq);
 }
 
-static void tq_freezethaw(struct thread_q *tq, bool frozen)
+/* bumps *word and wakes up to n threads sleeping on it */
+static void tq_futex_wake(struct thread_q *tq, volatile int *word, int n)
 {
+    __sync_fetch_and_add(word, 1);
+#ifdef __linux
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
     pthread_mutex_lock(&tq->mutex);
+    pthread_cond_broadcast(&tq->cond);
+    pthread_mutex_unlock(&tq->mutex);
+#endif
+}
 
-    tq->frozen = frozen;
+/* sleeps while *word is still seq; false once abstime has passed */
+static bool tq_futex_wait(struct thread_q *tq, volatile int *word, int seq,
+                          const struct timespec *abstime)
+{
+#ifdef __linux
+    if (syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                seq, abstime, NULL, FUTEX_BITSET_MATCH_ANY) && errno == ETIMEDOUT)
+        return false;
+    return true;
+#else
+    int rc = 0;
 
-    pthread_cond_signal(&tq->cond);
+    pthread_mutex_lock(&tq->mutex);
+    while (*word == seq && !rc) {
+        if (abstime)
+            rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+        else
+            rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+    }
     pthread_mutex_unlock(&tq->mutex);
+    return !rc;
+#endif
+}
+
+/* wakes the consumer if it sleeps, or is about to; one producer does */
+static void tq_wake(struct thread_q *tq)
+{
+    __sync_synchronize();
+    if (tq->sleeping && __sync_bool_compare_and_swap(&tq->sleeping, 1, 0))
+        tq_futex_wake(tq, &tq->wake_seq, 1);
+}
+
+static void tq_freezethaw(struct thread_q *tq, bool frozen)
+{
+    tq->frozen = frozen;
+    tq_wake(tq);
+    if (frozen)
+        tq_futex_wake(tq, &tq->space_seq, INT_MAX);
 }
 
 void tq_freeze(struct thread_q *tq)
@@ -1350,61 +2426,196 @@ void tq_thaw(struct thread_q *tq)
     tq_freezethaw(tq, false);
 }
 
-bool tq_push(struct thread_q *tq, void *data)
+/* false if the ring is full */
+static bool tq_add(struct thread_q *tq, void *data)
 {
-    struct tq_ent *ent;
-    bool rc = true;
+    struct tq_cell *cell;
+    unsigned long pos = tq->head;
+    long dif;
+
+    for (;;) {
+        cell = &tq->cells[pos & tq->mask];
+        dif = (long) (cell->seq - pos);
+        if (!dif) {
+            if (__sync_bool_compare_and_swap(&tq->head, pos, pos + 1))
+                break;
+        } else if (dif < 0)
+            return false;
+        pos = tq->head;
+    }
+    cell->data = data;
+    __sync_synchronize();
+    cell->seq = pos + 1;
+    return true;
+}
 
-    ent = calloc(1, sizeof(*ent));
-    if (!ent)
-        return false;
+/* consumer side: false if the ring is empty */
+static bool tq_take(struct thread_q *tq, void **data)
+{
+    struct tq_cell *cell = &tq->cells[tq->tail & tq->mask];
 
-    ent->data = data;
-    INIT_LIST_HEAD(&ent->q_node);
+    if ((long) (cell->seq - (tq->tail + 1)) < 0)
+        return false;
+    __sync_synchronize();
+    *data = cell->data;
+    cell->seq = tq->tail + tq->mask + 1;
+    tq->tail++;
+    /* let blocked producers in once half the ring is free again */
+    __sync_synchronize();
+    if (tq->full && tq->head - tq->tail <= TQ_SIZE / 2
+        && __sync_bool_compare_and_swap(&tq->full, 1, 0))
+        tq_futex_wake(tq, &tq->space_seq, INT_MAX);
+    return true;
+}
 
-    pthread_mutex_lock(&tq->mutex);
+/*
+ * False only if data was not queued. Once tq_add() has put it in the ring
+ * it belongs to the consumer, even if the queue is frozen meanwhile.
+ */
+bool tq_push(struct thread_q *tq, void *data)
+{
+    if (tq->frozen)
+        return false;
+    /* a full ring means the consumer is far behind: wait for it */
+    while (!tq_add(tq, data)) {
+        int seq = tq->space_seq;
 
-    if (!tq->frozen) {
-        list_add_tail(&ent->q_node, &tq->q);
-    } else {
-        free(ent);
-        rc = false;
+        if (tq->frozen)
+            return false;
+        tq->full = 1;
+        __sync_synchronize();
+        if (tq->head - tq->tail > TQ_SIZE / 2)
+            tq_futex_wait(tq, &tq->space_seq, seq, NULL);
     }
-
-    pthread_cond_signal(&tq->cond);
-    pthread_mutex_unlock(&tq->mutex);
-
-    return rc;
+    tq_wake(tq);
+    return true;
 }
 
 void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
 {
-    struct tq_ent *ent;
     void *rval = NULL;
-    int rc;
+    int seq;
+
+    while (!tq_take(tq, &rval)) {
+        if (tq->frozen)
+            return NULL;
+        seq = tq->wake_seq;
+        tq->sleeping = 1;
+        __sync_synchronize();
+        if (tq_take(tq, &rval) || tq->frozen) {
+            tq->sleeping = 0;
+            break;
+        }
+        if (!tq_futex_wait(tq, &tq->wake_seq, seq, abstime)) {
+            tq->sleeping = 0;
+            return NULL;
+        }
+        tq->sleeping = 0;
+    }
+    return rval;
+}
 
-    pthread_mutex_lock(&tq->mutex);
+/*
+ * --queue-bench: producer threads push to a single consumer through a
+ * thread_q and through the mutex-and-list queue it replaced.
+ */
+#define TQ_BENCH_ITEMS	200000
+
+struct lockq_ent {
+    void *data;
+    struct list_head q_node;
+};
 
-    if (!list_empty(&tq->q))
-        goto pop;
+struct lockq {
+    struct list_head q;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
 
-    if (abstime)
-        rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-    else
-        rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-    if (rc)
-        goto out;
-    if (list_empty(&tq->q))
-        goto out;
+static void lockq_push(struct lockq *lq, void *data)
+{
+    struct lockq_ent *ent = calloc(1, sizeof(*ent));
 
-pop:
-    ent = list_entry(tq->q.next, struct tq_ent, q_node);
-    rval = ent->data;
+    ent->data = data;
+    pthread_mutex_lock(&lq->mutex);
+    list_add_tail(&ent->q_node, &lq->q);
+    pthread_cond_signal(&lq->cond);
+    pthread_mutex_unlock(&lq->mutex);
+}
 
+static void *lockq_pop(struct lockq *lq)
+{
+    struct lockq_ent *ent;
+    void *data;
+
+    pthread_mutex_lock(&lq->mutex);
+    while (list_empty(&lq->q))
+        pthread_cond_wait(&lq->cond, &lq->mutex);
+    ent = list_entry(lq->q.next, struct lockq_ent, q_node);
     list_del(&ent->q_node);
+    pthread_mutex_unlock(&lq->mutex);
+    data = ent->data;
     free(ent);
+    return data;
+}
 
-out:
-    pthread_mutex_unlock(&tq->mutex);
-    return rval;
+struct tq_bench_arg {
+    struct thread_q *tq;
+    struct lockq *lq;
+};
+
+static void *tq_bench_producer(void *userdata)
+{
+    struct tq_bench_arg *arg = userdata;
+    int i;
+
+    for (i = 0; i < TQ_BENCH_ITEMS; i++) {
+        if (arg->tq)
+            tq_push(arg->tq, arg);
+        else
+            lockq_push(arg->lq, arg);
+    }
+    return NULL;
+}
+
+/* million items per second through the queue */
+static double tq_bench_run(int producers, struct tq_bench_arg *arg)
+{
+    pthread_t pth[16];
+    struct timeval start, end, diff;
+    long i, n = (long) producers * TQ_BENCH_ITEMS;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < producers; i++)
+        pthread_create(&pth[i], NULL, tq_bench_producer, arg);
+    for (i = 0; i < n; i++) {
+        if (arg->tq)
+            tq_pop(arg->tq, NULL);
+        else
+            lockq_pop(arg->lq);
+    }
+    for (i = 0; i < producers; i++)
+        pthread_join(pth[i], NULL);
+    gettimeofday(&end, NULL);
+    timeval_subtract(&diff, &end, &start);
+    return n / (diff.tv_sec * 1e6 + diff.tv_usec + 1);
+}
+
+void tq_bench(void)
+{
+    struct lockq lq;
+    struct tq_bench_arg ring = { tq_new(), NULL }, list = { NULL, &lq };
+    int producers;
+
+    INIT_LIST_HEAD(&lq.q);
+    pthread_mutex_init(&lq.mutex, NULL);
+    pthread_cond_init(&lq.cond, NULL);
+
+    for (producers = 1; producers <= 16; producers *= 2)
+        applog(LOG_INFO, "queue bench, %2d producers: ring %.2f Mitems/s, mutex list %.2f Mitems/s",
+               producers, tq_bench_run(producers, &ring), tq_bench_run(producers, &list));
+
+    tq_free(ring.tq);
+    pthread_cond_destroy(&lq.cond);
+    pthread_mutex_destroy(&lq.mutex);
 }
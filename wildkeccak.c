@@ -311,24 +311,28 @@ void wild_keccak_hash_dbl(uint8_t *restrict md, const uint8_t *restrict in)
 	return;
 }
 
-/*int scanhash_wildkeccak(int thr_id, uint32_t *restrict pdata, const uint32_t *restrict ptarget, uint32_t max_nonce, unsigned long *restrict hashes_done)
+// Same contract as the CUDA scanhash_wildkeccak, one nonce at a time; a
+// full res ends the scan right after its last candidate.
+int scanhash_wildkeccak_cpu(int thr_id, uint32_t *restrict pdata, const uint32_t *restrict ptarget, uint32_t max_nonce, unsigned long *restrict hashes_done, struct scan_results *restrict res)
 {
-    uint32_t hash[8] __attribute__((aligned(16))), n = *((uint32_t *)(((uint8_t *)pdata) + 1)) - 1;
-	const uint32_t first_nonce = n + 1;
-    
-	do 
+	uint32_t hash[8] __attribute__((aligned(16)));
+	uint32_t *nonceptr = (uint32_t *)(((uint8_t *)pdata) + 1);
+	uint32_t n = *nonceptr;
+	const uint32_t first_nonce = n;
+	
+	res->count = 0;
+	while(likely(n < max_nonce && res->count < SCAN_RESULTS_MAX && !work_restart[thr_id].restart))
 	{
-		*((uint32_t *)(((uint8_t *)pdata) + 1)) = ++n;
+		*nonceptr = n;
 		wild_keccak_hash_dbl((uint8_t *)hash, (uint8_t *)pdata);
-		if (unlikely(hash[7] < ptarget[7])) 
-		{
-			*hashes_done = n - first_nonce + 1;
-			return true;
-		}
-	} while (likely((n <= max_nonce && !work_restart[thr_id].restart)));
-
-	*hashes_done = n - first_nonce + 1;
-	return 0;
-}*/
+		if(unlikely(hash[7] <= ptarget[7]))
+			res->nonce[res->count++] = n;
+		++n;
+	}
+	
+	*nonceptr = n;
+	*hashes_done = n - first_nonce;
+	return(res->count);
+}
 	
 	
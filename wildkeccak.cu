@@ -5,7 +5,7 @@ extern "C" {
 static cudaStream_t *scr_copy_streams;
 static ulonglong4 **d_scratchpad;
 static uint64_t **d_input;
-static uint32_t **d_retnonce;
+static struct scan_results **d_results;
 
 extern unsigned int CUDABlocks, CUDAThreads;
 
@@ -143,14 +143,15 @@ __device__ ulonglong4 operator^(const ulonglong4 &a, const ulonglong4 &b)
 #define MIX_ALL MIX(vst0); MIX(vst4); MIX(vst8); MIX(vst12); MIX(vst16); MIX(vst20);
 
 __global__
-void wk(uint32_t * __restrict__ retnonce, const uint64_t * __restrict__ input, const ulonglong4 * __restrict__ scratchpad, const uint32_t scr_size, uint64_t nonce, const uint32_t target)
+void wk(struct scan_results * __restrict__ res, const uint64_t * __restrict__ input, const ulonglong4 * __restrict__ scratchpad, const uint32_t scr_size, uint64_t nonce, const uint32_t target)
 {
 	ulonglong4 vst0, vst4, vst8, vst12, vst16, vst20;
 	uint64_t __restrict__ bc[5], st24, tmp1, tmp2;
 
 	nonce += (blockDim.x * blockIdx.x) + threadIdx.x;
 
-	vst0 	= make_ulonglong4((nonce << 8) + (input[0] & 0xFF), input[1] & 0xFFFFFFFFFFFFFF00ULL, input[2], input[3]);
+	/* the blob nonce is bytes 1..8: its top byte goes into the second word */
+	vst0 	= make_ulonglong4((nonce << 8) + (input[0] & 0xFF), (input[1] & 0xFFFFFFFFFFFFFF00ULL) | (nonce >> 56), input[2], input[3]);
 	vst4 	= make_ulonglong4(input[4], input[5], input[6], input[7]);
 	vst8 	= make_ulonglong4(input[8], input[9], (input[10] & 0xFF) | 0x100, 0);
 	vst12 	= make_ulonglong4(0, 0, 0, 0);
@@ -187,16 +188,20 @@ void wk(uint32_t * __restrict__ retnonce, const uint64_t * __restrict__ input, c
 
 	LASTRND2();
 
-	if((st3 >> 32) <= target) *retnonce = (uint32_t)nonce;
+	if((st3 >> 32) <= target)
+	{
+		uint32_t slot = atomicAdd(&res->count, 1);
+		if(slot < SCAN_RESULTS_MAX) res->nonce[slot] = (uint32_t)nonce;
+	}
 }
 
-extern "C" void UpdateScratchpad(uint32_t threads)
+static void UpdateScratchpad(uint32_t threads, uint64_t start, uint64_t count)
 {
 	for(int i = 0; i < threads; ++i)
-		cudaMemcpyAsync(d_scratchpad[i], pscratchpad_buff, scratchpad_size << 3, cudaMemcpyHostToDevice, scr_copy_streams[i]);
+		cudaMemcpyAsync((uint64_t *)d_scratchpad[i] + start, pscratchpad_buff + start, count << 3, cudaMemcpyHostToDevice, scr_copy_streams[i]);
 }
 
-extern "C" void InitCUDA(uint32_t threads, char **devstrs)
+static bool InitCUDA(uint32_t threads, char **devstrs)
 {
 	struct cudaDeviceProp prop;
 	int numdevs;
@@ -204,20 +209,20 @@ extern "C" void InitCUDA(uint32_t threads, char **devstrs)
 	if(cudaGetDeviceCount(&numdevs) != cudaSuccess)
 	{
 		applog(LOG_ERR, "Something's fucked - can't get number of CUDA devices.");
-		exit(0);
+		return(false);
 	}
 
 	if(threads > numdevs)
 	{
 		applog(LOG_ERR, "You specified more threads than there are CUDA devices, you idiot.");
-		exit(0);
+		return(false);
 	}
 
 	scr_copy_streams = (cudaStream_t *)malloc(sizeof(cudaStream_t) * threads);
 
 	d_scratchpad = (ulonglong4 **)malloc(sizeof(ulonglong4 *) * threads);
 	d_input = (uint64_t **)malloc(sizeof(uint64_t *) * threads);
-	d_retnonce = (uint32_t **)malloc(sizeof(uint32_t *) * threads);
+	d_results = (struct scan_results **)malloc(sizeof(struct scan_results *) * threads);
 
 	for(int i = 0; i < threads; ++i)
 	{
@@ -225,9 +230,10 @@ extern "C" void InitCUDA(uint32_t threads, char **devstrs)
 		devstrs[i] = strdup(prop.name);
 	}
 
+	return(true);
 }
 
-extern "C" void CUDASetDevice(uint32_t thread_id)
+static void CUDASetDevice(uint32_t thread_id)
 {
 	int i = (int) thread_id;
 	cudaSetDevice(i);
@@ -242,62 +248,64 @@ extern "C" void CUDASetDevice(uint32_t thread_id)
 	cudaMalloc(&d_scratchpad[i], WILD_KECCAK_SCRATCHPAD_BUFFSIZE);
 
 #ifdef USE_MAPPED_MEMORY
-	cudaHostAlloc(&d_retnonce[i], sizeof(uint32_t), cudaHostAllocMapped);
+	cudaHostAlloc(&d_results[i], sizeof(struct scan_results), cudaHostAllocMapped);
 #else
-	cudaMalloc(&d_retnonce[i], sizeof(uint32_t));
+	cudaMalloc(&d_results[i], sizeof(struct scan_results));
 #endif
 	cudaMalloc(&d_input[i], 88);
 	cudaStreamCreate(&scr_copy_streams[i]);
 }
 
-extern "C" int scanhash_wildkeccak(int thr_id, uint32_t *pdata, const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done)
+static int scanhash_wildkeccak(int thr_id, uint32_t *pdata, const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done, struct scan_results *res)
 {
 	uint32_t *nonceptr = ((uint32_t *)(((uint8_t *)pdata) + 1));
 	uint32_t n = *nonceptr;
-	uint32_t first = n, blocks = CUDABlocks, threads = CUDAThreads;
+	uint32_t first = n, blocks = CUDABlocks, threads = CUDAThreads, count;
+	/* the kernel walks the low word, the high one (lane and prefixes) stays */
+	uint64_t hi = (uint64_t)nonceptr[1] << 32;
+	struct scan_results *dres = d_results[thr_id];
 
 	cudaMemcpy(d_input[thr_id], pdata, 88, cudaMemcpyHostToDevice);
 
 #ifdef USE_MAPPED_MEMORY
-	*(d_retnonce[thr_id]) = 0xFFFFFFFFUL;
-	uint32_t *dnonce;
-	cudaHostGetDevicePointer(&dnonce, d_retnonce[thr_id], 0);
+	d_results[thr_id]->count = 0;
+	cudaHostGetDevicePointer(&dres, d_results[thr_id], 0);
 #else
-	cudaMemset(d_retnonce[thr_id], 0xFF, sizeof(uint32_t));
-	uint32_t h_retnonce;
+	cudaMemset(dres, 0, sizeof(uint32_t));
 #endif
 
 	cudaStreamSynchronize(scr_copy_streams[thr_id]);
 
+	/* candidates pile up in the device ring, only a full one ends the batch early */
 	do
 	{
 		dim3 block(blocks);
 		dim3 thread(threads);
 
+		wk<<<block, thread, 0, scr_copy_streams[thr_id]>>>(dres, d_input[thr_id], d_scratchpad[thr_id], (uint32_t)(scratchpad_size >> 2), hi | n, ptarget[7]);
+		n += blocks * threads;
 #ifdef USE_MAPPED_MEMORY
-		wk<<<block, thread, 0, scr_copy_streams[thr_id]>>>(dnonce, d_input[thr_id], d_scratchpad[thr_id], (uint32_t)(scratchpad_size >> 2), n, ptarget[7]);
-		//cudaDeviceSynchronize();
-		if(*(d_retnonce[thr_id]) < 0xFFFFFFFFU)
-		{
-			*nonceptr = *(d_retnonce[thr_id]);
-			*hashes_done = *(d_retnonce[thr_id]) - first + 1;
-			return(1);
-		}
+		cudaStreamSynchronize(scr_copy_streams[thr_id]);
+		count = d_results[thr_id]->count;
 #else
-		wk<<<block, thread, 0, scr_copy_streams[thr_id]>>>(d_retnonce[thr_id], d_input[thr_id], d_scratchpad[thr_id], (uint32_t)(scratchpad_size >> 2), n, ptarget[7]);
-		//cudaDeviceSynchronize();
-		cudaMemcpy(&h_retnonce, d_retnonce[thr_id], sizeof(uint32_t), cudaMemcpyDeviceToHost);
-		if(h_retnonce < 0xFFFFFFFFU)
-		{
-			*nonceptr = h_retnonce;
-			*hashes_done = h_retnonce - first + 1;
-			return(1);
-		}
+		cudaMemcpy(&count, &dres->count, sizeof(count), cudaMemcpyDeviceToHost);
 #endif
+	} while(count < SCAN_RESULTS_MAX && n < max_nonce && !work_restart[thr_id].restart);
 
-		n += blocks * threads;
-	} while(n < max_nonce && !work_restart[thr_id].restart);
+	res->count = count;
+	if(count > SCAN_RESULTS_MAX) count = SCAN_RESULTS_MAX;
+#ifdef USE_MAPPED_MEMORY
+	memcpy(res->nonce, d_results[thr_id]->nonce, count * sizeof(uint32_t));
+#else
+	if(count) cudaMemcpy(res->nonce, dres->nonce, count * sizeof(uint32_t), cudaMemcpyDeviceToHost);
+#endif
 
-	*hashes_done = n - first + 1;
-	return(0);
+	*nonceptr = n;
+	*hashes_done = n - first;
+	return(count);
 }
+
+extern "C" const struct scan_device cuda_device = {
+	"cuda", 60, 130,
+	InitCUDA, CUDASetDevice, UpdateScratchpad, scanhash_wildkeccak
+};